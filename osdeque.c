@@ -0,0 +1,143 @@
+#include "osdeque.h"
+#include <stdlib.h>
+
+#define OS_DEQUE_INITIAL_SIZE 64
+
+
+static OSDequeArray *osCreateDequeArray(long size) {
+    OSDequeArray *a = malloc(sizeof(OSDequeArray) + sizeof(void *) * (size_t) size);
+
+    if (a == NULL) {
+        return NULL;
+    }
+
+    a->size = size;
+    a->prev = NULL;
+
+    return a;
+}
+
+// doubles the array, the old one is kept since thieves may still read it
+static OSDequeArray *osGrowDeque(OSDeque *d, OSDequeArray *a, long top, long bottom) {
+    OSDequeArray *bigger = osCreateDequeArray(a->size * 2);
+    long i;
+
+    if (bigger == NULL) {
+        abort();
+    }
+
+    for (i = top; i < bottom; ++i) {
+        bigger->buffer[i & (bigger->size - 1)] = __atomic_load_n(&a->buffer[i & (a->size - 1)], __ATOMIC_RELAXED);
+    }
+
+    bigger->prev = a;
+    __atomic_store_n(&d->array, bigger, __ATOMIC_RELEASE);
+
+    return bigger;
+}
+
+OSDeque *osCreateDeque() {
+    OSDeque *d = malloc(sizeof(OSDeque));
+
+    if (d == NULL) {
+        return NULL;
+    }
+
+    d->top = d->bottom = 0;
+    d->array = osCreateDequeArray(OS_DEQUE_INITIAL_SIZE);
+
+    if (d->array == NULL) {
+        free(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+void osDestroyDeque(OSDeque *d) {
+    OSDequeArray *a, *prev;
+
+    if (d == NULL) {
+        return;
+    }
+
+    for (a = d->array; a != NULL; a = prev) {
+        prev = a->prev;
+        free(a);
+    }
+
+    free(d);
+}
+
+int osIsDequeEmpty(OSDeque *d) {
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    long bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+    return (bottom <= top);
+}
+
+void osPushBottom(OSDeque *d, void *data) {
+    long bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    OSDequeArray *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+    if (bottom - top > a->size - 1) {
+        a = osGrowDeque(d, a, top, bottom);
+    }
+
+    __atomic_store_n(&a->buffer[bottom & (a->size - 1)], data, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+void *osPopBottom(OSDeque *d) {
+    long bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    OSDequeArray *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    long top;
+    void *data;
+
+    __atomic_store_n(&d->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    // deque was already empty
+    if (top > bottom) {
+        __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    data = __atomic_load_n(&a->buffer[bottom & (a->size - 1)], __ATOMIC_RELAXED);
+
+    // last element, race against thieves for it
+    if (top == bottom) {
+        if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            data = NULL;
+        }
+        __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    return data;
+}
+
+void *osStealTop(OSDeque *d) {
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    long bottom;
+    OSDequeArray *a;
+    void *data;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    data = __atomic_load_n(&a->buffer[top & (a->size - 1)], __ATOMIC_RELAXED);
+
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    return data;
+}
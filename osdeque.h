@@ -0,0 +1,40 @@
+#ifndef __OS_DEQUE__
+#define __OS_DEQUE__
+
+#ifndef OS_CACHE_LINE
+#define OS_CACHE_LINE 64
+#endif
+
+
+// chase-lev work-stealing deque
+// the owner pushes and pops at the bottom, any other thread steals at the top
+typedef struct os_deque_array {
+    long size;
+    struct os_deque_array *prev;
+    void *buffer[];
+} OSDequeArray;
+
+typedef struct os_deque {
+    long top;
+    char topPad[OS_CACHE_LINE - sizeof(long)];
+    long bottom;
+    OSDequeArray *array;
+} OSDeque;
+
+OSDeque *osCreateDeque();
+
+void osDestroyDeque(OSDeque *deque);
+
+int osIsDequeEmpty(OSDeque *deque);
+
+// owner only
+void osPushBottom(OSDeque *deque, void *data);
+
+// owner only
+void *osPopBottom(OSDeque *deque);
+
+// any thread, returns NULL if empty or if another thread won the race
+void *osStealTop(OSDeque *deque);
+
+
+#endif
@@ -62,3 +62,46 @@ void *osDequeue(OSQueue *q) {
     free(previousHead);
     return data;
 }
+
+void osEnqueueNode(OSQueue *q, OSNode *node) {
+    node->next = NULL;
+
+    if (q->tail == NULL) {
+        q->head = q->tail = node;
+        return;
+    }
+
+    q->tail->next = node;
+    q->tail = node;
+}
+
+void osEnqueueChain(OSQueue *q, OSNode *first, OSNode *last) {
+    last->next = NULL;
+
+    if (q->tail == NULL) {
+        q->head = first;
+        q->tail = last;
+        return;
+    }
+
+    q->tail->next = first;
+    q->tail = last;
+}
+
+OSNode *osDequeueNode(OSQueue *q) {
+    OSNode *previousHead;
+
+    previousHead = q->head;
+
+    if (previousHead == NULL) {
+        return NULL;
+    }
+
+    q->head = q->head->next;
+
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+
+    return previousHead;
+}
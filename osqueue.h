@@ -22,5 +22,13 @@ void osEnqueue(OSQueue *queue, void *data);
 
 void *osDequeue(OSQueue *queue);
 
+// intrusive versions, the caller owns the node so nothing is allocated or freed
+void osEnqueueNode(OSQueue *queue, OSNode *node);
+
+OSNode *osDequeueNode(OSQueue *queue);
+
+// appends nodes already linked from first to last
+void osEnqueueChain(OSQueue *queue, OSNode *first, OSNode *last);
+
 
 #endif
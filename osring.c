@@ -0,0 +1,110 @@
+#include "osring.h"
+#include <stdlib.h>
+
+OSRing *osCreateRing(size_t capacity) {
+    OSRing *r;
+    size_t size = 2;
+    size_t i;
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    if (posix_memalign((void **) &r, OS_CACHE_LINE, sizeof(OSRing)) != 0) {
+        return NULL;
+    }
+
+    r->cells = malloc(sizeof(OSRingCell) * size);
+
+    if (r->cells == NULL) {
+        free(r);
+        return NULL;
+    }
+
+    for (i = 0; i < size; ++i) {
+        r->cells[i].sequence = i;
+        r->cells[i].data = NULL;
+    }
+
+    r->mask = size - 1;
+    r->head = r->tail = 0;
+
+    return r;
+}
+
+void osDestroyRing(OSRing *r) {
+    if (r == NULL) {
+        return;
+    }
+
+    free(r->cells);
+    free(r);
+}
+
+int osIsRingEmpty(OSRing *r) {
+    return (osRingSize(r) == 0);
+}
+
+size_t osRingSize(OSRing *r) {
+    size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    return (head > tail) ? head - tail : 0;
+}
+
+int osRingEnqueue(OSRing *r, void *data) {
+    size_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    OSRingCell *cell;
+
+    while (1) {
+        cell = &r->cells[pos & r->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long) sequence - (long) pos;
+
+        if (diff == 0) {
+            // cell is free, try to claim it
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // cell still holds data from the previous lap
+            return -1;
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = data;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void *osRingDequeue(OSRing *r) {
+    size_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    OSRingCell *cell;
+    void *data;
+
+    while (1) {
+        cell = &r->cells[pos & r->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long) sequence - (long) (pos + 1);
+
+        if (diff == 0) {
+            // cell is full, try to claim it
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // producer did not fill this cell yet
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    data = cell->data;
+    __atomic_store_n(&cell->sequence, pos + r->mask + 1, __ATOMIC_RELEASE);
+
+    return data;
+}
@@ -0,0 +1,45 @@
+#ifndef __OS_RING__
+#define __OS_RING__
+
+#include <stddef.h>
+
+#ifndef OS_CACHE_LINE
+#define OS_CACHE_LINE 64
+#endif
+
+
+// bounded lock-free multi-producer multi-consumer queue
+// every cell carries a sequence number telling whose turn it is
+typedef struct os_ring_cell {
+    size_t sequence;
+    void *data;
+} OSRingCell;
+
+typedef struct os_ring {
+    OSRingCell *cells;
+    size_t mask;
+    char cellsPad[OS_CACHE_LINE - sizeof(OSRingCell *) - sizeof(size_t)];
+    size_t head;
+    char headPad[OS_CACHE_LINE - sizeof(size_t)];
+    size_t tail;
+    char tailPad[OS_CACHE_LINE - sizeof(size_t)];
+} OSRing;
+
+// capacity is rounded up to a power of two
+OSRing *osCreateRing(size_t capacity);
+
+void osDestroyRing(OSRing *ring);
+
+int osIsRingEmpty(OSRing *ring);
+
+// approximate while other threads use the ring
+size_t osRingSize(OSRing *ring);
+
+// returns 0 on success, -1 if the ring is full
+int osRingEnqueue(OSRing *ring, void *data);
+
+// returns NULL if the ring is empty
+void *osRingDequeue(OSRing *ring);
+
+
+#endif
@@ -0,0 +1,117 @@
+#include "osslab.h"
+#include <stdlib.h>
+
+#define OS_SLAB_NIL 0xFFFFFFFFu
+#define OS_SLAB_ALIGN 64
+
+#define OS_SLAB_INDEX(top) ((unsigned int) ((top) & 0xFFFFFFFFull))
+#define OS_SLAB_TOP(tag, index) ((((tag) + 1) << 32) | (unsigned long long) (index))
+
+
+static int osIsInSlab(OSSlab *s, void *object) {
+    char *p = (char *) object;
+
+    return (p >= s->memory && p < s->memory + s->objectSize * s->capacity);
+}
+
+OSSlab *osCreateSlab(size_t objectSize, unsigned int capacity) {
+    OSSlab *s = malloc(sizeof(OSSlab));
+    unsigned int i;
+
+    if (s == NULL) {
+        return NULL;
+    }
+
+    // keep every object 16 bytes aligned
+    s->objectSize = (objectSize + 15) & ~(size_t) 15;
+    s->capacity = capacity;
+    s->memory = NULL;
+    s->next = NULL;
+    s->top = OS_SLAB_NIL;
+
+    if (capacity == 0) {
+        return s;
+    }
+
+    if (posix_memalign((void **) &s->memory, OS_SLAB_ALIGN, s->objectSize * capacity) != 0) {
+        free(s);
+        return NULL;
+    }
+
+    s->next = malloc(sizeof(unsigned int) * capacity);
+
+    if (s->next == NULL) {
+        free(s->memory);
+        free(s);
+        return NULL;
+    }
+
+    for (i = 0; i < capacity; ++i) {
+        s->next[i] = (i + 1 < capacity) ? i + 1 : OS_SLAB_NIL;
+    }
+    s->top = 0;
+
+    return s;
+}
+
+void osDestroySlab(OSSlab *s) {
+    if (s == NULL) {
+        return;
+    }
+
+    free(s->next);
+    free(s->memory);
+    free(s);
+}
+
+void *osSlabAlloc(OSSlab *s) {
+    unsigned long long top = __atomic_load_n(&s->top, __ATOMIC_ACQUIRE);
+
+    while (OS_SLAB_INDEX(top) != OS_SLAB_NIL) {
+        unsigned int index = OS_SLAB_INDEX(top);
+        unsigned int next = __atomic_load_n(&s->next[index], __ATOMIC_RELAXED);
+
+        // the tag changes on every pop, so a stale next never wins
+        if (__atomic_compare_exchange_n(&s->top, &top, OS_SLAB_TOP(top >> 32, next), 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return s->memory + s->objectSize * index;
+        }
+    }
+
+    return malloc(s->objectSize);
+}
+
+void osSlabFree(OSSlab *s, void *object) {
+    osSlabFreeBatch(s, &object, 1);
+}
+
+void osSlabFreeBatch(OSSlab *s, void **objects, int n) {
+    unsigned int first = OS_SLAB_NIL, last = OS_SLAB_NIL;
+    int i;
+
+    // link the slab objects into one chain, return the others to the heap
+    for (i = 0; i < n; ++i) {
+        if (!osIsInSlab(s, objects[i])) {
+            free(objects[i]);
+            continue;
+        }
+
+        unsigned int index = (unsigned int) (((char *) objects[i] - s->memory) / s->objectSize);
+        if (first == OS_SLAB_NIL) {
+            first = index;
+        } else {
+            __atomic_store_n(&s->next[last], index, __ATOMIC_RELAXED);
+        }
+        last = index;
+    }
+
+    if (first == OS_SLAB_NIL) {
+        return;
+    }
+
+    unsigned long long top = __atomic_load_n(&s->top, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&s->next[last], OS_SLAB_INDEX(top), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&s->top, &top, OS_SLAB_TOP(top >> 32, first), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,30 @@
+#ifndef __OS_SLAB__
+#define __OS_SLAB__
+
+#include <stddef.h>
+
+
+// fixed-size objects preallocated in one block
+// free objects are kept on a lock-free stack, when it runs out objects come from the heap
+typedef struct os_slab {
+    char *memory;
+    size_t objectSize;
+    unsigned int capacity;
+    unsigned int *next;
+    // index of the top object in the low half, aba tag in the high half
+    unsigned long long top;
+} OSSlab;
+
+OSSlab *osCreateSlab(size_t objectSize, unsigned int capacity);
+
+void osDestroySlab(OSSlab *slab);
+
+void *osSlabAlloc(OSSlab *slab);
+
+void osSlabFree(OSSlab *slab, void *object);
+
+// frees n objects with a single push
+void osSlabFreeBatch(OSSlab *slab, void **objects, int n);
+
+
+#endif
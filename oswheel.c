@@ -0,0 +1,168 @@
+#include "oswheel.h"
+#include <stdlib.h>
+
+#define OS_WHEEL_MASK (OS_WHEEL_SLOTS - 1)
+#define OS_WHEEL_SPAN(level) (1ULL << (OS_WHEEL_BITS * ((level) + 1)))
+
+
+static void osWheelLink(OSTimer *head, OSTimer *timer) {
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void osWheelUnlink(OSTimer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+// puts the timer in the lowest level whose span covers it, past the top level it waits in the last slot
+static void osWheelPlace(OSWheel *w, OSTimer *timer) {
+    unsigned long long expires = timer->expires;
+    int level;
+
+    if (expires <= w->now) {
+        expires = w->now + 1;
+    }
+
+    for (level = 0; level < OS_WHEEL_LEVELS - 1; ++level) {
+        if (expires - w->now < OS_WHEEL_SPAN(level)) {
+            break;
+        }
+    }
+    if (expires - w->now >= OS_WHEEL_SPAN(level)) {
+        expires = w->now + OS_WHEEL_SPAN(level) - 1;
+    }
+
+    osWheelLink(&w->slots[level][(expires >> (OS_WHEEL_BITS * level)) & OS_WHEEL_MASK], timer);
+}
+
+// moves the timers of a slot down the wheel
+static void osWheelCascade(OSWheel *w, int level, int slot) {
+    OSTimer *head = &w->slots[level][slot];
+
+    while (head->next != head) {
+        OSTimer *timer = head->next;
+        osWheelUnlink(timer);
+        osWheelPlace(w, timer);
+    }
+}
+
+OSWheel *osCreateWheel(unsigned long long now) {
+    OSWheel *w = malloc(sizeof(OSWheel));
+    int level, slot;
+
+    if (w == NULL) {
+        return NULL;
+    }
+
+    for (level = 0; level < OS_WHEEL_LEVELS; ++level) {
+        for (slot = 0; slot < OS_WHEEL_SLOTS; ++slot) {
+            w->slots[level][slot].next = w->slots[level][slot].prev = &w->slots[level][slot];
+        }
+    }
+    w->now = now;
+    w->count = 0;
+
+    return w;
+}
+
+void osDestroyWheel(OSWheel *w) {
+    free(w);
+}
+
+void osWheelAdd(OSWheel *w, OSTimer *timer, unsigned long long expires) {
+    timer->expires = expires;
+    osWheelPlace(w, timer);
+    w->count++;
+}
+
+void osWheelRemove(OSWheel *w, OSTimer *timer) {
+    osWheelUnlink(timer);
+    w->count--;
+}
+
+long long osWheelNextTick(OSWheel *w) {
+    long long next = -1;
+    int level, slot;
+
+    if (w->count == 0) {
+        return -1;
+    }
+
+    // a slot is reached when the ticks below its level wrap around to it
+    for (level = 0; level < OS_WHEEL_LEVELS; ++level) {
+        int shift = OS_WHEEL_BITS * level;
+        unsigned long long current = w->now >> shift;
+
+        for (slot = 0; slot < OS_WHEEL_SLOTS; ++slot) {
+            if (w->slots[level][slot].next == &w->slots[level][slot]) {
+                continue;
+            }
+
+            unsigned long long distance = (unsigned long long) (slot - (long long) (current & OS_WHEEL_MASK)) & OS_WHEEL_MASK;
+            if (distance == 0) {
+                distance = OS_WHEEL_SLOTS;
+            }
+
+            long long tick = (long long) ((current + distance) << shift);
+            if (next < 0 || tick < next) {
+                next = tick;
+            }
+        }
+    }
+
+    return next;
+}
+
+OSTimer *osWheelAdvance(OSWheel *w, unsigned long long now) {
+    OSTimer *expired = NULL, *last = NULL;
+
+    while (w->now < now) {
+        // nothing happens before the next tick that has timers, skip to it
+        long long next = osWheelNextTick(w);
+        if (next < 0 || (unsigned long long) next > now) {
+            w->now = now;
+            break;
+        }
+        w->now = (unsigned long long) next;
+
+        // lower levels wrapped around, bring the higher slot's timers down
+        int level;
+        for (level = 1; level < OS_WHEEL_LEVELS; ++level) {
+            if ((w->now & ((1ULL << (OS_WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            osWheelCascade(w, level, (int) ((w->now >> (OS_WHEEL_BITS * level)) & OS_WHEEL_MASK));
+        }
+
+        OSTimer *head = &w->slots[0][w->now & OS_WHEEL_MASK];
+        while (head->next != head) {
+            OSTimer *timer = head->next;
+            osWheelUnlink(timer);
+            w->count--;
+
+            // a timer past the top level's span only waited here, put it back
+            if (timer->expires > w->now) {
+                osWheelPlace(w, timer);
+                w->count++;
+                continue;
+            }
+
+            if (last == NULL) {
+                expired = timer;
+            } else {
+                last->next = timer;
+            }
+            last = timer;
+        }
+    }
+
+    if (last != NULL) {
+        last->next = NULL;
+    }
+
+    return expired;
+}
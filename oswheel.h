@@ -0,0 +1,39 @@
+#ifndef __OS_WHEEL__
+#define __OS_WHEEL__
+
+#define OS_WHEEL_BITS 6
+#define OS_WHEEL_SLOTS (1 << OS_WHEEL_BITS)
+#define OS_WHEEL_LEVELS 4
+
+
+// hierarchical timer wheel counting in ticks, not thread safe
+// level i holds the timers due within 64^(i+1) ticks, they move down a level as their time comes
+typedef struct os_timer {
+    struct os_timer *next, *prev;
+    unsigned long long expires;
+} OSTimer;
+
+typedef struct os_wheel {
+    unsigned long long now;
+    long count;
+    // every slot is a circular list with the slot itself as its head
+    OSTimer slots[OS_WHEEL_LEVELS][OS_WHEEL_SLOTS];
+} OSWheel;
+
+OSWheel *osCreateWheel(unsigned long long now);
+
+void osDestroyWheel(OSWheel *wheel);
+
+// a timer already due expires on the next tick
+void osWheelAdd(OSWheel *wheel, OSTimer *timer, unsigned long long expires);
+
+void osWheelRemove(OSWheel *wheel, OSTimer *timer);
+
+// moves the wheel up to now and returns the expired timers linked through next
+OSTimer *osWheelAdvance(OSWheel *wheel, unsigned long long now);
+
+// tick the wheel has to be advanced to before anything can expire, -1 if it's empty
+long long osWheelNextTick(OSWheel *wheel);
+
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -206,6 +207,157 @@ void printingCannabisText(void* a)
     printf("\n");
 }
 
+void countTask(void* a)
+{
+    __sync_fetch_and_add((int*)(a), 1);
+}
+
+void* squareTask(void* a)
+{
+    long num = (long)(a);
+    return (void*)(num*num);
+}
+
+void markRange(long begin, long end, void* a)
+{
+    long i;
+    for (i = begin; i < end; ++i)
+    {
+        ((int*)(a))[i]++;
+    }
+}
+
+int priorityOrder[4];
+int priorityOrderSize = 0;
+
+void recordPriority(void* a)
+{
+    priorityOrder[priorityOrderSize++] = (int)(long)(a);
+}
+
+typedef struct cpuRecord
+{
+    int cpu;
+    int runs;
+    int unpinned;
+}CpuRecord;
+
+void recordCpu(void* a)
+{
+    CpuRecord* record = (CpuRecord*)a;
+    cpu_set_t cpus;
+    pthread_getaffinity_np(pthread_self(),sizeof(cpus),&cpus);
+    // pinned to just the cpu we asked for, and running there
+    if (CPU_COUNT(&cpus)!=1 || !CPU_ISSET(record->cpu,&cpus) || sched_getcpu()!=record->cpu)
+    {
+        __sync_fetch_and_add(&record->unpinned, 1);
+    }
+    __sync_fetch_and_add(&record->runs, 1);
+}
+
+typedef struct runLog
+{
+    long long startNs[16];
+    int runs;
+}RunLog;
+
+long long monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (long long)now.tv_sec*1000000000LL + now.tv_nsec;
+}
+
+// first run is slow and overruns its period, the rest are quick
+void logRun(void* a)
+{
+    RunLog* log = (RunLog*)a;
+    int run = __sync_fetch_and_add(&log->runs, 0);
+    if (run < 16)
+    {
+        log->startNs[run] = monotonicNs();
+    }
+    if (run == 0)
+    {
+        usleep(250000);
+    }
+    __sync_fetch_and_add(&log->runs, 1);
+}
+
+typedef struct loopInPool
+{
+    ThreadPool* tp;
+    int calls;
+    int result;
+}LoopInPool;
+
+void slowRange(long begin, long end, void* a)
+{
+    (void)begin;
+    (void)end;
+    __sync_fetch_and_add(&((LoopInPool*)(a))->calls, 1);
+    usleep(100000);
+}
+
+void parallelForInPool(void* a)
+{
+    LoopInPool* loop = (LoopInPool*)(a);
+    loop->result = tpParallelFor(loop->tp,0,64,1,slowRange,loop);
+}
+
+void copyCount(void* a)
+{
+    // keeps how many tasks had counted when this one ran
+    int* count = (int*)(((void**)(a))[0]);
+    int* seen = (int*)(((void**)(a))[1]);
+    *seen = __sync_fetch_and_add(count,0);
+}
+
+typedef struct starvation
+{
+    ThreadPool* tp;
+    int highRuns;
+    int highRunsBeforeLow;
+}Starvation;
+
+void highForever(void* a)
+{
+    // keeps a high task queued until the low one ran, or long enough to show it never would
+    Starvation* state = (Starvation*)(a);
+    int runs = __sync_add_and_fetch(&state->highRuns, 1);
+    usleep(2000);
+    if (__sync_fetch_and_add(&state->highRunsBeforeLow,0)<0 && runs<200)
+    {
+        tpInsertTaskPriority(state->tp,TP_PRIORITY_HIGH,highForever,state);
+    }
+}
+
+void lowAfterAging(void* a)
+{
+    Starvation* state = (Starvation*)(a);
+    __sync_lock_test_and_set(&state->highRunsBeforeLow, __sync_fetch_and_add(&state->highRuns,0));
+}
+
+void* destroyWithoutWaiting(void* a)
+{
+    tpDestroy((ThreadPool*)(a),0);
+    return NULL;
+}
+
+void waitForFlag(void* a)
+{
+    while (!__sync_fetch_and_add((int*)(a), 0))
+    {
+        usleep(1000);
+    }
+}
+
+void setFlagLater(void* a)
+{
+    usleep(50000);
+    __sync_fetch_and_add((int*)(a), 1);
+}
+
 void badfunction(void *a)
 {
     //this is a function that should not run,
@@ -213,6 +365,102 @@ void badfunction(void *a)
     assert(0==1);
 }
 
+void fanOutAndWait(void* a)
+{
+    // the only worker waits for sub tasks queued behind it
+    ThreadPool* tp = (ThreadPool*)(((void**)(a))[0]);
+    int* count = (int*)(((void**)(a))[1]);
+    TPGroup group;
+    int i;
+    tpGroupInit(&group,tp);
+    for(i=0; i<4; ++i)
+    {
+        assert(tpGroupInsert(&group,countTask,count)==0);
+    }
+    tpGroupWait(&group);
+    assert(*count==4);
+
+    TPHandle* handle = tpSubmit(tp,squareTask,(void*)3);
+    void* result = NULL;
+    assert(tpWait(handle,&result)==0);
+    assert((long)result==9);
+    tpReleaseHandle(handle);
+    __sync_fetch_and_add(count,1);
+}
+
+void insertChildren(void* a)
+{
+    // children of a running task run newest first on its worker
+    ThreadPool* tp = (ThreadPool*)(a);
+    long i;
+    for(i=1; i<=3; ++i)
+    {
+        tpInsertTask(tp,recordPriority,(void*)i);
+    }
+}
+
+typedef struct {
+    int running;
+    int next;
+    int outOfOrder;
+} KeyState;
+
+void keyedStep(void* a)
+{
+    // tasks of a key never overlap and come in order
+    KeyState* key = (KeyState*)(((void**)(a))[0]);
+    int step = (int)(long)(((void**)(a))[1]);
+    if (__sync_fetch_and_add(&key->running,1)!=0 || key->next!=step)
+    {
+        key->outOfOrder = 1;
+    }
+    key->next = step + 1;
+    __sync_fetch_and_sub(&key->running,1);
+}
+
+typedef struct {
+    int* sum;
+    int values[4];
+} SmallArgs;
+
+void addSmallArgs(void* a)
+{
+    SmallArgs* args = (SmallArgs*)(a);
+    __sync_fetch_and_add(args->sum,args->values[0]+args->values[3]);
+}
+
+typedef struct {
+    int* sum;
+    int values[100];
+} BigArgs;
+
+void addBigArgs(void* a)
+{
+    BigArgs* args = (BigArgs*)(a);
+    __sync_fetch_and_add(args->sum,args->values[0]+args->values[99]);
+}
+
+void keepInserting(void* a)
+{
+    // inserts until the pool goes down, every insert that succeeded must still run
+    ThreadPool* tp = (ThreadPool*)(((void**)(a))[0]);
+    int* inserted = (int*)(((void**)(a))[1]);
+    int* count = (int*)(((void**)(a))[2]);
+    while (tpInsertTask(tp,countTask,count)==0)
+    {
+        __sync_fetch_and_add(inserted,1);
+    }
+}
+
+void readPipe(void* a)
+{
+    // the fd is ready, the read doesn't block
+    int* ends = (int*)(a);
+    char byte = 0;
+    assert(read(ends[0],&byte,1)==1);
+    __sync_fetch_and_add(&ends[2],byte);
+}
+
 void printOK()
 {
     printf("\n");
@@ -551,6 +799,926 @@ void test_thread_pool_inside_thread_pool_2()
     printf(" \n");
 }
 
+void test_many_threads_many_short_tasks()
+{
+    halt(); //ignore
+    int count = 0;
+    int i;
+
+    ThreadPool* tp = tpCreate(16);
+    for(i=0; i<100000; ++i)
+    {
+        tpInsertTask(tp,countTask,&count);
+    }
+
+    tpDestroy(tp,1);
+    assert(count==100000);
+    printOK();
+    printf(" \n");
+}
+
+void test_ring_queue_many_short_tasks()
+{
+    halt(); //ignore
+    int count = 0;
+    int i;
+
+    // small ring, so part of the tasks overflow to the list
+    TPConfig config;
+    tpConfigInit(&config, 8);
+    config.ringCapacity = 64;
+    ThreadPool* tp = tpCreateWithConfig(&config);
+    for(i=0; i<100000; ++i)
+    {
+        tpInsertTask(tp,countTask,&count);
+    }
+
+    tpDestroy(tp,1);
+    assert(count==100000);
+    printOK();
+    printf(" \n");
+}
+
+void test_small_task_slab()
+{
+    halt(); //ignore
+    int count = 0;
+    int i;
+
+    // slab runs out, the rest of the tasks come from the heap
+    TPConfig config;
+    tpConfigInit(&config, 4);
+    config.taskSlabCapacity = 8;
+    ThreadPool* tp = tpCreateWithConfig(&config);
+    for(i=0; i<100000; ++i)
+    {
+        tpInsertTask(tp,countTask,&count);
+    }
+
+    tpDestroy(tp,1);
+    assert(count==100000);
+    printOK();
+    printf(" \n");
+}
+
+void test_insert_tasks_batch()
+{
+    halt(); //ignore
+    int count1 = 0;
+    int count2 = 0;
+    void (*funcs[1000])(void *);
+    void* args[1000];
+    int i;
+
+    ThreadPool* tp = tpCreate(5);
+    for(i=0; i<1000; ++i)
+    {
+        funcs[i] = countTask;
+        args[i] = (i%2) ? &count1 : &count2;
+    }
+    tpInsertTasks(tp,funcs,args,1000);
+    tpInsertTaskBatch(tp,countTask,args,1000);
+
+    tpDestroy(tp,1);
+    assert(count1==1000);
+    assert(count2==1000);
+    printOK();
+    printf(" \n");
+}
+
+void test_fixed_spin_idle_policy()
+{
+    halt(); //ignore
+    int count = 0;
+    int i;
+
+    // workers always spin and yield before they park
+    TPConfig config;
+    tpConfigInit(&config, 4);
+    config.idleSpins = 100000;
+    config.idleYields = 10;
+    config.adaptiveSpin = 0;
+    ThreadPool* tp = tpCreateWithConfig(&config);
+    for(i=0; i<1000; ++i)
+    {
+        tpInsertTask(tp,countTask,&count);
+        if (i%100 == 0)
+        {
+            usleep(1000);
+        }
+    }
+
+    tpDestroy(tp,1);
+    assert(count==1000);
+    printOK();
+    printf(" \n");
+}
+
+void test_submit_and_wait()
+{
+    halt(); //ignore
+    TPHandle* handles[100];
+    void* result;
+    long i;
+
+    ThreadPool* tp = tpCreate(4);
+    for(i=0; i<100; ++i)
+    {
+        handles[i] = tpSubmit(tp,squareTask,(void*)i);
+    }
+    for(i=0; i<100; ++i)
+    {
+        assert(tpWait(handles[i],&result)==0);
+        assert((long)(result)==i*i);
+        assert(tpTryWait(handles[i],&result)==0);
+        assert(tpWaitTimeout(handles[i],10,&result)==0);
+        tpReleaseHandle(handles[i]);
+    }
+
+    tpDestroy(tp,1);
+
+    // a task dropped by a pool going down tells its waiter it never ran
+    int flag = 0;
+    pthread_t destroyer;
+    TPStats stats;
+    tp = tpCreate(1);
+    tpInsertTask(tp,waitForFlag,&flag);
+    do
+    {
+        usleep(1000);
+        assert(tpGetStats(tp,&stats)==0);
+    } while (stats.queueDepth>0);
+    TPHandle* handle = tpSubmit(tp,squareTask,(void*)3);
+    assert(handle!=NULL);
+    assert(tpTryWait(handle,&result)==-1);
+    assert(pthread_create(&destroyer,NULL,destroyWithoutWaiting,tp)==0);
+    result = (void*)1;
+    assert(tpWait(handle,&result)==1);
+    assert(result==NULL);
+    assert(tpTryWait(handle,&result)==1);
+    assert(tpWaitTimeout(handle,10,&result)==1);
+    tpReleaseHandle(handle);
+    __sync_fetch_and_add(&flag,1);
+    assert(pthread_join(destroyer,NULL)==0);
+    printOK();
+    printf(" \n");
+}
+
+void test_wait_idle_between_phases()
+{
+    halt(); //ignore
+    int count = 0;
+    int phase;
+    int i;
+
+    ThreadPool* tp = tpCreate(4);
+    for(phase=1; phase<=10; ++phase)
+    {
+        for(i=0; i<1000; ++i)
+        {
+            tpInsertTask(tp,countTask,&count);
+        }
+        tpWaitIdle(tp);
+        assert(count==phase*1000);
+    }
+
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+void test_parallel_for()
+{
+    halt(); //ignore
+    int marks[10000] = {0};
+    int i;
+
+    ThreadPool* tp = tpCreate(4);
+    assert(tpParallelFor(tp,0,10000,16,markRange,marks)==0);
+    for(i=0; i<10000; ++i)
+    {
+        assert(marks[i]==1);
+    }
+
+    tpDestroy(tp,1);
+
+    // a pool going down drops the pieces that didn't start, the loop still returns
+    LoopInPool loop = {NULL, 0, 0};
+    tp = tpCreate(1);
+    loop.tp = tp;
+    tpInsertTask(tp,parallelForInPool,&loop);
+    for(i=0; i<1000 && __sync_fetch_and_add(&loop.calls,0)==0; ++i)
+    {
+        usleep(1000);
+    }
+    tpDestroy(tp,0);
+    assert(loop.result==-1);
+    assert(loop.calls<64);
+    printOK();
+    printf(" \n");
+}
+
+void test_insert_task_priority()
+{
+    halt(); //ignore
+    int flag = 0;
+
+    // single thread busy while the tasks are inserted, then they run by level
+    ThreadPool* tp = tpCreate(1);
+    tpInsertTask(tp,waitForFlag,&flag);
+    usleep(10000);
+    tpInsertTaskPriority(tp,TP_PRIORITY_LOW,recordPriority,(void*)TP_PRIORITY_LOW);
+    tpInsertTaskPriority(tp,TP_PRIORITY_NORMAL,recordPriority,(void*)TP_PRIORITY_NORMAL);
+    tpInsertTaskPriority(tp,TP_PRIORITY_HIGH,recordPriority,(void*)TP_PRIORITY_HIGH);
+    tpInsertTaskPriority(tp,TP_PRIORITY_CRITICAL,recordPriority,(void*)TP_PRIORITY_CRITICAL);
+    __sync_fetch_and_add(&flag, 1);
+
+    tpDestroy(tp,1);
+    assert(priorityOrderSize==4);
+    assert(priorityOrder[0]==TP_PRIORITY_CRITICAL);
+    assert(priorityOrder[1]==TP_PRIORITY_HIGH);
+    assert(priorityOrder[2]==TP_PRIORITY_NORMAL);
+    assert(priorityOrder[3]==TP_PRIORITY_LOW);
+
+    // with aging a low task gets its turn even while high tasks keep coming
+    Starvation state = {NULL, 0, -1};
+    TPConfig config;
+    tpConfigInit(&config,1);
+    config.priorityAgingMs = 20;
+    tp = tpCreateWithConfig(&config);
+    state.tp = tp;
+    flag = 0;
+    tpInsertTask(tp,waitForFlag,&flag);
+    usleep(10000);
+    tpInsertTaskPriority(tp,TP_PRIORITY_LOW,lowAfterAging,&state);
+    tpInsertTaskPriority(tp,TP_PRIORITY_HIGH,highForever,&state);
+    __sync_fetch_and_add(&flag, 1);
+    tpWaitIdle(tp);
+    assert(state.highRunsBeforeLow>=1);
+    assert(state.highRunsBeforeLow<100);
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+
+// the function gets thread pool and a test on its num of live threads
+// it polls for up to 2 seconds until the test holds, and returns the last count
+int waitForLiveThreads(ThreadPool* tp, int (*isDone)(int))
+{
+    TPStats stats;
+    int i;
+    for(i=0; i<200; ++i)
+    {
+        assert(tpGetStats(tp,&stats)==0);
+        if (isDone(stats.liveThreads))
+        {
+            break;
+        }
+        usleep(10000);
+    }
+    return stats.liveThreads;
+}
+
+int isNone(int liveThreads)
+{
+    return liveThreads==0;
+}
+
+int isMany(int liveThreads)
+{
+    return liveThreads>1;
+}
+
+
+void test_elastic_grow_and_shrink()
+{
+    halt(); //ignore
+    int flag = 0;
+    int count = 0;
+    int i;
+
+    // no thread until the first task, more while one worker is stuck
+    ThreadPool* tp = tpCreateElastic(0,4,20);
+    assert(waitForLiveThreads(tp,isNone)==0);
+    tpInsertTask(tp,waitForFlag,&flag);
+    for(i=0; i<100; ++i)
+    {
+        tpInsertTask(tp,countTask,&count);
+    }
+    assert(waitForLiveThreads(tp,isMany)>1);
+    __sync_fetch_and_add(&flag, 1);
+    tpWaitIdle(tp);
+    assert(count==100);
+
+    // idle workers go away and come back for new tasks
+    assert(waitForLiveThreads(tp,isNone)==0);
+    for(i=0; i<100; ++i)
+    {
+        tpInsertTask(tp,countTask,&count);
+    }
+    tpWaitIdle(tp);
+    assert(count==200);
+
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_worker_placement()
+{
+    halt(); //ignore
+    int cpus[1];
+    int badCpus[] = {-1};
+    placement placements[] = {TP_PLACEMENT_COMPACT, TP_PLACEMENT_SCATTER, TP_PLACEMENT_LIST, TP_PLACEMENT_NUMA};
+    int count = 0;
+    int p;
+    int i;
+
+    // the first cpu we're allowed to run on
+    cpu_set_t allowed;
+    assert(sched_getaffinity(0,sizeof(allowed),&allowed)==0);
+    for(cpus[0]=0; !CPU_ISSET(cpus[0],&allowed); ++cpus[0]);
+
+    for(p=0; p<4; ++p)
+    {
+        TPConfig config;
+        tpConfigInit(&config,4);
+        config.placement = placements[p];
+        config.cpus = cpus;
+        config.cpuCount = 1;
+        ThreadPool* tp = tpCreateWithConfig(&config);
+        assert(tp!=NULL);
+        for(i=0; i<1000; ++i)
+        {
+            tpInsertTask(tp,countTask,&count);
+        }
+        tpDestroy(tp,1);
+        assert(count==(p+1)*1000);
+    }
+
+    // every worker of a listed pool runs pinned to its cpu
+    CpuRecord record = {cpus[0], 0, 0};
+    TPConfig listConfig;
+    tpConfigInit(&listConfig,4);
+    listConfig.placement = TP_PLACEMENT_LIST;
+    listConfig.cpus = cpus;
+    listConfig.cpuCount = 1;
+    ThreadPool* tp = tpCreateWithConfig(&listConfig);
+    assert(tp!=NULL);
+    for(i=0; i<100; ++i)
+    {
+        tpInsertTask(tp,recordCpu,&record);
+    }
+    tpDestroy(tp,1);
+    assert(record.runs==100);
+    assert(record.unpinned==0);
+
+    // a cpu we can't run on
+    TPConfig config;
+    tpConfigInit(&config,4);
+    config.placement = TP_PLACEMENT_LIST;
+    config.cpus = badCpus;
+    config.cpuCount = 1;
+    assert(tpCreateWithConfig(&config)==NULL);
+
+    printOK();
+    printf(" \n");
+}
+
+
+void test_bounded_queue()
+{
+    halt(); //ignore
+    int flag = 0;
+    int count = 0;
+    int i;
+
+    // single thread stuck, so the queue fills up
+    TPConfig config;
+    tpConfigInit(&config,1);
+    config.queueCapacity = 4;
+    ThreadPool* tp = tpCreateWithConfig(&config);
+    tpInsertTask(tp,waitForFlag,&flag);
+    usleep(10000);
+    for(i=0; i<4; ++i)
+    {
+        assert(tpTryInsertTask(tp,countTask,&count)==0);
+    }
+    assert(tpTryInsertTask(tp,countTask,&count)==-1);
+    assert(tpInsertTaskTimeout(tp,countTask,&count,20)==-1);
+
+    // blocks until the worker is free again
+    ThreadPool* other = tpCreate(1);
+    tpInsertTask(other,setFlagLater,&flag);
+    assert(tpInsertTask(tp,countTask,&count)==0);
+    assert(flag==1);
+
+    tpDestroy(other,1);
+    tpDestroy(tp,1);
+    assert(count==5);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_runtime_stats()
+{
+    halt(); //ignore
+    int count = 0;
+    int i;
+
+    ThreadPool* tp = tpCreate(2);
+    for(i=0; i<1000; ++i)
+    {
+        tpInsertTask(tp,countTask,&count);
+    }
+    tpWaitIdle(tp);
+
+    TPStats stats;
+    assert(tpGetStats(tp,&stats)==0);
+    assert(stats.total.executed==1000);
+    assert(stats.queueDepth==0);
+    assert(stats.inFlight==0);
+    assert(stats.runTime.total>0 && stats.runTime.total<=1000);
+    assert(stats.queueWait.total==stats.runTime.total);
+    assert(tpHistogramPercentile(&stats.runTime,0.5)<=tpHistogramPercentile(&stats.runTime,0.99));
+
+    // the workers' counters add up to the total
+    TPCounters counters;
+    unsigned long long executed = 0;
+    for(i=0; i<2; ++i)
+    {
+        assert(tpGetWorkerStats(tp,i,&counters)==0);
+        executed += counters.executed;
+    }
+    assert(executed==1000);
+    assert(tpGetWorkerStats(tp,2,&counters)==-1);
+
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_dump_trace()
+{
+    halt(); //ignore
+    int count = 0;
+    int i;
+    char line[64];
+
+    TPConfig config;
+    tpConfigInit(&config,2);
+    config.traceEvents = 128;
+    ThreadPool* tp = tpCreateWithConfig(&config);
+    for(i=0; i<100; ++i)
+    {
+        tpInsertTask(tp,countTask,&count);
+    }
+    tpWaitIdle(tp);
+    assert(tpDumpTrace(tp,"/tmp/tp_trace_test.json")==0);
+    tpDestroy(tp,1);
+
+    FILE* file = fopen("/tmp/tp_trace_test.json","r");
+    assert(file!=NULL);
+    assert(fgets(line,sizeof(line),file)!=NULL);
+    assert(strncmp(line,"{\"displayTimeUnit\"",18)==0);
+    fclose(file);
+    remove("/tmp/tp_trace_test.json");
+
+    // not traced
+    tp = tpCreate(2);
+    assert(tpDumpTrace(tp,"/tmp/tp_trace_test.json")==-1);
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_schedule_after()
+{
+    halt(); //ignore
+    int count = 0;
+
+    ThreadPool* tp = tpCreate(2);
+    TPTimerId soon = tpScheduleAfter(tp,20000,countTask,&count);
+    TPTimerId later = tpScheduleAfter(tp,200000,countTask,&count);
+    assert(soon!=0 && later!=0);
+    assert(count==0);
+    assert(tpCancelTimer(tp,later)==0);
+    assert(tpCancelTimer(tp,later)==-1);
+
+    usleep(100000);
+    tpWaitIdle(tp);
+    assert(count==1);
+    assert(tpCancelTimer(tp,soon)==-1);
+
+    // not due yet when the pool goes down
+    tpScheduleAfter(tp,1000000,countTask,&count);
+    tpDestroy(tp,1);
+    assert(count==1);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_schedule_every()
+{
+    halt(); //ignore
+    int count = 0;
+
+    ThreadPool* tp = tpCreate(2);
+    assert(tpScheduleEvery(tp,0,countTask,&count)==0);
+    TPTimerId id = tpScheduleEvery(tp,10000,countTask,&count);
+    assert(id!=0);
+
+    usleep(105000);
+    assert(tpCancelTimer(tp,id)==0);
+    assert(tpCancelTimer(tp,id)==-1);
+    tpWaitIdle(tp);
+    int runs = __atomic_load_n(&count,__ATOMIC_SEQ_CST);
+    assert(runs>=5 && runs<=11);
+
+    usleep(50000);
+    tpWaitIdle(tp);
+    assert(__atomic_load_n(&count,__ATOMIC_SEQ_CST)==runs);
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+
+// the function gets log of a periodic task with a 100ms period, and time it was scheduled at
+// it returns ms between the task's run and the deadline it ran for
+long long msFromDeadline(RunLog* log, int run, long long startNs, int deadline)
+{
+    long long ms = (log->startNs[run] - startNs)/1000000 - deadline*100;
+    return ms < 0 ? -ms : ms;
+}
+
+
+void test_periodic_overrun()
+{
+    halt(); //ignore
+    overrun policies[] = {TP_OVERRUN_SKIP, TP_OVERRUN_COALESCE};
+    int p;
+    int i;
+
+    for(p=0; p<2; ++p)
+    {
+        RunLog log;
+        memset(&log,0,sizeof(log));
+        TPConfig config;
+        tpConfigInit(&config,2);
+        config.periodicOverrun = policies[p];
+        ThreadPool* tp = tpCreateWithConfig(&config);
+
+        // first run takes 250ms, so the deadlines at 200ms and 300ms come while it runs
+        long long startNs = monotonicNs();
+        TPTimerId id = tpScheduleEvery(tp,100000,logRun,&log);
+        assert(id!=0);
+        for(i=0; i<200 && __sync_fetch_and_add(&log.runs,0)<4; ++i)
+        {
+            usleep(10000);
+        }
+        assert(tpCancelTimer(tp,id)==0);
+        tpWaitIdle(tp);
+        assert(log.runs>=4);
+
+        assert(msFromDeadline(&log,0,startNs,1)<40);
+        if (policies[p] == TP_OVERRUN_SKIP)
+        {
+            // missed deadlines are dropped, the next run keeps to the schedule
+            assert(msFromDeadline(&log,1,startNs,4)<40);
+            assert(msFromDeadline(&log,2,startNs,5)<40);
+            assert(msFromDeadline(&log,3,startNs,6)<40);
+        }
+        else
+        {
+            // missed deadlines make one run right after the slow one, then it's back on schedule
+            assert(log.startNs[1]-log.startNs[0] >= 250000000LL);
+            assert(msFromDeadline(&log,1,startNs,3)<90);
+            assert(msFromDeadline(&log,2,startNs,4)<40);
+            assert(msFromDeadline(&log,3,startNs,5)<40);
+        }
+        tpDestroy(tp,1);
+    }
+
+    printOK();
+    printf(" \n");
+}
+
+
+void test_cancellation_token()
+{
+    halt(); //ignore
+    int count = 0;
+    int flag = 0;
+    int i;
+
+    // the only worker is held until the tasks are cancelled
+    ThreadPool* tp = tpCreate(1);
+    TPToken* token = tpCreateToken();
+    assert(token!=NULL);
+    tpInsertTask(tp,waitForFlag,&flag);
+    for(i=0; i<10; ++i)
+    {
+        assert(tpInsertTaskCancellable(tp,token,0,countTask,&count)==0);
+    }
+    assert(tpInsertTaskCancellable(tp,NULL,0,countTask,&count)==0);
+    tpCancelToken(token);
+    assert(tpIsTokenCancelled(token));
+    tpReleaseToken(token);
+    __sync_fetch_and_add(&flag,1);
+    tpWaitIdle(tp);
+    assert(count==1);
+
+    // deadline passes while the worker is busy
+    flag = 0;
+    tpInsertTask(tp,waitForFlag,&flag);
+    assert(tpInsertTaskCancellable(tp,NULL,1000,countTask,&count)==0);
+    assert(tpInsertTaskCancellable(tp,NULL,10000000,countTask,&count)==0);
+    usleep(20000);
+    __sync_fetch_and_add(&flag,1);
+    tpWaitIdle(tp);
+    assert(count==2);
+
+    TPStats stats;
+    tpGetStats(tp,&stats);
+    assert(stats.total.dropped==11);
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_group_wait_helps()
+{
+    halt(); //ignore
+    int count = 0;
+
+    ThreadPool* tp = tpCreate(1);
+    void* args[2] = {tp,&count};
+    tpInsertTask(tp,fanOutAndWait,args);
+    tpWaitIdle(tp);
+    assert(count==5);
+
+    // from outside the pool the wait just blocks
+    TPGroup group;
+    tpGroupInit(&group,tp);
+    tpGroupInsert(&group,countTask,&count);
+    tpGroupInsert(&group,countTask,&count);
+    assert(tpGroupWait(&group)==0);
+    assert(count==7);
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_local_lifo_submission()
+{
+    halt(); //ignore
+
+    ThreadPool* tp = tpCreate(1);
+    priorityOrderSize = 0;
+    tpInsertTask(tp,insertChildren,tp);
+    tpWaitIdle(tp);
+    assert(priorityOrderSize==3);
+    assert(priorityOrder[0]==3 && priorityOrder[1]==2 && priorityOrder[2]==1);
+
+    // tasks from outside keep their order
+    int flag = 0;
+    priorityOrderSize = 0;
+    tpInsertTask(tp,waitForFlag,&flag);
+    tpInsertTask(tp,recordPriority,(void*)1);
+    tpInsertTask(tp,recordPriority,(void*)2);
+    __sync_fetch_and_add(&flag,1);
+    tpWaitIdle(tp);
+    assert(priorityOrder[0]==1 && priorityOrder[1]==2);
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_keyed_tasks()
+{
+    halt(); //ignore
+    KeyState keys[4];
+    void* args[4][200][2];
+    int i, k;
+    memset(keys,0,sizeof(keys));
+
+    ThreadPool* tp = tpCreate(4);
+    for(i=0; i<200; ++i)
+    {
+        for(k=0; k<4; ++k)
+        {
+            args[k][i][0] = &keys[k];
+            args[k][i][1] = (void*)(long)i;
+            assert(tpInsertTaskKeyed(tp,(unsigned long)k,keyedStep,args[k][i])==0);
+        }
+    }
+    tpWaitIdle(tp);
+    for(k=0; k<4; ++k)
+    {
+        assert(keys[k].next==200);
+        assert(!keys[k].outOfOrder);
+    }
+    tpDestroy(tp,1);
+
+    // keyed tasks take room in a bounded queue
+    int flag = 0;
+    int count = 0;
+    TPConfig bounded;
+    tpConfigInit(&bounded,1);
+    bounded.queueCapacity = 3;
+    tp = tpCreateWithConfig(&bounded);
+    tpInsertTask(tp,waitForFlag,&flag);
+    usleep(10000);
+    assert(tpInsertTaskKeyed(tp,1,countTask,&count)==0);
+    assert(tpInsertTaskKeyed(tp,1,countTask,&count)==0);
+    assert(tpTryInsertTask(tp,countTask,&count)==-1);
+    __sync_fetch_and_add(&flag,1);
+    tpWaitIdle(tp);
+    assert(count==2);
+    tpDestroy(tp,1);
+
+    // room for a single task is enough, a strand's runner doesn't take a slot of its own
+    count = 0;
+    bounded.queueCapacity = 1;
+    tp = tpCreateWithConfig(&bounded);
+    for(i=0; i<100; ++i)
+    {
+        assert(tpInsertTaskKeyed(tp,(unsigned long)(i%3),countTask,&count)==0);
+    }
+    tpWaitIdle(tp);
+    assert(count==100);
+    tpDestroy(tp,1);
+
+    // a busy key gives way to other tasks after a batch instead of holding the worker
+    int seen = -1;
+    void* seenArgs[2] = {&count,&seen};
+    flag = 0;
+    count = 0;
+    tp = tpCreate(1);
+    tpInsertTask(tp,waitForFlag,&flag);
+    usleep(10000);
+    for(i=0; i<200; ++i)
+    {
+        assert(tpInsertTaskKeyed(tp,7,countTask,&count)==0);
+    }
+    tpInsertTask(tp,copyCount,seenArgs);
+    __sync_fetch_and_add(&flag,1);
+    tpWaitIdle(tp);
+    assert(count==200);
+    assert(seen>=0 && seen<=32);
+    tpDestroy(tp,1);
+
+    // a key that waits holds up none of the others
+    flag = 0;
+    count = 0;
+    tp = tpCreate(2);
+    assert(tpInsertTaskKeyed(tp,1000,waitForFlag,&flag)==0);
+    for(i=0; i<500; ++i)
+    {
+        assert(tpInsertTaskKeyed(tp,(unsigned long)i,countTask,&count)==0);
+    }
+    for(i=0; i<1000 && __sync_fetch_and_add(&count,0)<500; ++i)
+    {
+        usleep(1000);
+    }
+    assert(count==500);
+    __sync_fetch_and_add(&flag,1);
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_insert_task_copy()
+{
+    halt(); //ignore
+    int sum = 0;
+    int i;
+
+    // the args may change or go away as soon as the insert returns
+    ThreadPool* tp = tpCreate(2);
+    SmallArgs small;
+    small.sum = &sum;
+    BigArgs big;
+    big.sum = &sum;
+    for(i=0; i<10; ++i)
+    {
+        small.values[0] = i;
+        small.values[3] = 1;
+        assert(tpInsertTaskCopy(tp,addSmallArgs,&small,sizeof(small))==0);
+        big.values[0] = i;
+        big.values[99] = 100;
+        assert(tpInsertTaskCopy(tp,addBigArgs,&big,sizeof(big))==0);
+    }
+    memset(&small,0,sizeof(small));
+    memset(&big,0,sizeof(big));
+    tpWaitIdle(tp);
+    assert(sum==2*45+10+1000);
+    tpDestroy(tp,1);
+
+    // no args need no bytes, a full queue takes no copy
+    int flag = 0;
+    big.sum = &sum;
+    TPConfig config;
+    tpConfigInit(&config,1);
+    config.queueCapacity = 1;
+    tp = tpCreateWithConfig(&config);
+    assert(tpInsertTaskCopy(tp,hello,NULL,0)==0);
+    tpInsertTask(tp,waitForFlag,&flag);
+    usleep(10000);
+    assert(tpInsertTaskCopy(tp,addBigArgs,&big,sizeof(big))==0);
+    assert(tpInsertTaskCopyTimeout(tp,addBigArgs,&big,sizeof(big),10)==-1);
+    assert(tpInsertTaskCopyTimeout(tp,addBigArgs,&big,sizeof(big),-1)==-1);
+    __sync_fetch_and_add(&flag,1);
+    tpDestroy(tp,1);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_destroy_while_inserting()
+{
+    halt(); //ignore
+    int inserted = 0;
+    int count = 0;
+
+    ThreadPool* tp = tpCreate(2);
+    void* args[3] = {tp,&inserted,&count};
+    tpInsertTask(tp,keepInserting,args);
+    usleep(5000);
+    tpDestroy(tp,1);
+    assert(inserted>0);
+    assert(count==inserted);
+    printOK();
+    printf(" \n");
+}
+
+
+void test_watch_fd()
+{
+    halt(); //ignore
+    int ends[3] = {0,0,0};
+    int i;
+    assert(pipe(ends)==0);
+
+    ThreadPool* tp = tpCreate(2);
+    assert(tpWatchFd(tp,ends[0],EPOLLIN,readPipe,ends)==0);
+    assert(tpWatchFd(tp,ends[0],EPOLLIN,readPipe,ends)==-1);
+    usleep(20000);
+    assert(__sync_fetch_and_add(&ends[2],0)==0);
+
+    char byte = 7;
+    assert(write(ends[1],&byte,1)==1);
+    for(i=0; i<1000 && __sync_fetch_and_add(&ends[2],0)==0; ++i)
+    {
+        usleep(1000);
+    }
+    tpWaitIdle(tp);
+    assert(ends[2]==7);
+    assert(tpUnwatchFd(tp,ends[0])==-1);
+
+    // watched again, then taken off before anything is written
+    assert(tpWatchFd(tp,ends[0],EPOLLIN,readPipe,ends)==0);
+    assert(tpUnwatchFd(tp,ends[0])==0);
+    assert(write(ends[1],&byte,1)==1);
+    usleep(20000);
+    tpWaitIdle(tp);
+    assert(ends[2]==7);
+
+    // a fd that fired stays on epoll and is re-armed, one closed meanwhile is added again
+    int round;
+    for(round=0; round<2; ++round)
+    {
+        assert(tpWatchFd(tp,ends[0],EPOLLIN,readPipe,ends)==0);
+        for(i=0; i<1000 && __sync_fetch_and_add(&ends[2],0)!=14+7*round; ++i)
+        {
+            usleep(1000);
+        }
+        tpWaitIdle(tp);
+        assert(ends[2]==14+7*round);
+        close(ends[0]);
+        close(ends[1]);
+        assert(pipe(ends)==0);
+        assert(write(ends[1],&byte,1)==1);
+    }
+
+    tpDestroy(tp,1);
+    close(ends[0]);
+    close(ends[1]);
+    printOK();
+    printf(" \n");
+}
+
 
 int main()
 {
@@ -606,6 +1774,102 @@ int main()
 //    test_thread_pool_inside_thread_pool_2();
 
 
+    printf("test_many_threads_many_short_tasks...\n");
+    test_many_threads_many_short_tasks();
+
+
+    printf("test_ring_queue_many_short_tasks...\n");
+    test_ring_queue_many_short_tasks();
+
+
+    printf("test_small_task_slab...\n");
+    test_small_task_slab();
+
+
+    printf("test_insert_tasks_batch...\n");
+    test_insert_tasks_batch();
+
+
+    printf("test_fixed_spin_idle_policy...\n");
+    test_fixed_spin_idle_policy();
+
+
+    printf("test_submit_and_wait...\n");
+    test_submit_and_wait();
+
+
+    printf("test_wait_idle_between_phases...\n");
+    test_wait_idle_between_phases();
+
+
+    printf("test_parallel_for...\n");
+    test_parallel_for();
+
+
+    printf("test_insert_task_priority...\n");
+    test_insert_task_priority();
+
+
+    printf("test_elastic_grow_and_shrink...\n");
+    test_elastic_grow_and_shrink();
+
+
+    printf("test_worker_placement...\n");
+    test_worker_placement();
+
+
+    printf("test_bounded_queue...\n");
+    test_bounded_queue();
+
+
+    printf("test_runtime_stats...\n");
+    test_runtime_stats();
+
+
+    printf("test_dump_trace...\n");
+    test_dump_trace();
+
+
+    printf("test_schedule_after...\n");
+    test_schedule_after();
+
+
+    printf("test_schedule_every...\n");
+    test_schedule_every();
+
+
+    printf("test_periodic_overrun...\n");
+    test_periodic_overrun();
+
+
+    printf("test_cancellation_token...\n");
+    test_cancellation_token();
+
+
+    printf("test_group_wait_helps...\n");
+    test_group_wait_helps();
+
+
+    printf("test_local_lifo_submission...\n");
+    test_local_lifo_submission();
+
+
+    printf("test_keyed_tasks...\n");
+    test_keyed_tasks();
+
+
+    printf("test_insert_task_copy...\n");
+    test_insert_task_copy();
+
+
+    printf("test_destroy_while_inserting...\n");
+    test_destroy_while_inserting();
+
+
+    printf("test_watch_fd...\n");
+    test_watch_fd();
+
+
     printEnd();
     return 0;
 }
\ No newline at end of file
@@ -1,152 +1,3207 @@
+#define _GNU_SOURCE
+#include "threadPool.h"
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+
+// the function displays error message and exits
+void sys_error() {
+    write(2, "Error in system call\n", strlen("Error in system call\n"));
+    exit(-1);
+}
+
+
+// max tasks a worker moves from the queue to its deque at once
+#define TP_BATCH_SIZE 16
+
+// gaps between submissions longer than this count as this
+#define TP_MAX_ARRIVAL_NS 1000000000L
+// one of this many submissions of a thread updates the time between submissions
+#define TP_ARRIVAL_SAMPLE 16
+// numa nodes looked up in sysfs and capacity of their rings unless ringCapacity is set
+#define TP_MAX_NODES 64
+#define TP_NODE_RING_CAPACITY 1024
+// timeout of a submission that waits for room as long as it takes
+#define TP_WAIT_FOREVER -1
+// end of the free timers list
+#define TP_TIMER_NONE UINT_MAX
+// one of this many tasks is timed for the histograms
+#define TP_STATS_SAMPLE 16
+// the state word holds the state in its low bit and adds this for every submitter inside an insert
+#define TP_STATE_MASK 1
+#define TP_SUBMITTER 2
+
+// a task is two cache lines, the hot fields and then the copied args, so slab tasks never straddle lines
+typedef char TaskSizeCheck[(sizeof(Task) == 2 * OS_CACHE_LINE) ? 1 : -1];
+
+// hint to the cpu that we are in a spin loop
+#if defined(__x86_64__) || defined(__i386__)
+#define TP_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define TP_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define TP_CPU_RELAX() do {} while (0)
+#endif
+
+
+// the worker running on this thread, NULL outside of thread pools
+static __thread Worker *currentWorker = NULL;
+
+// submissions made by the calling thread, to sample the time between submissions
+static __thread unsigned int submitCount = 0;
+
+static void *exec(void *x);
+static void dropTask(ThreadPool *tp, Task *task);
+static void runStrand(void *x);
+
+
+// the function returns monotonic time in nanoseconds
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// the function gets futex word, expected value and optional absolute monotonic deadline
+// it sleeps while the word holds the value, returns -1 on timeout
+static int futexWait(int *word, int value, const struct timespec *deadline) {
+    struct timespec timeout;
+    struct timespec *timeoutPtr = NULL;
+
+    // futex takes a relative timeout
+    if (deadline != NULL) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout.tv_sec = deadline->tv_sec - now.tv_sec;
+        timeout.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+        if (timeout.tv_nsec < 0) {
+            timeout.tv_sec -= 1;
+            timeout.tv_nsec += 1000000000L;
+        }
+        if (timeout.tv_sec < 0) {
+            return -1;
+        }
+        timeoutPtr = &timeout;
+    }
+
+    if (syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, timeoutPtr, NULL, 0) != 0) {
+        if (errno == ETIMEDOUT) {
+            return -1;
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            sys_error();
+        }
+    }
+
+    return 0;
+}
+
+
+// the function gets futex word and max num of threads to wake
+// it wakes up to n threads sleeping on it
+static void futexWake(int *word, int n) {
+    if (syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0) < 0) {
+        sys_error();
+    }
+}
+
+
+// the function gets futex word
+// it wakes all threads sleeping on it
+static void futexWakeAll(int *word) {
+    futexWake(word, INT_MAX);
+}
+
+
+// the function gets thread pool
+// it returns the state without the submitters counted in the same word
+static state lifecycle(ThreadPool *tp) {
+    return (state) (__atomic_load_n(&tp->state, __ATOMIC_SEQ_CST) & TP_STATE_MASK);
+}
+
+
+// the function gets thread pool
+// it counts the caller as a submitter if the pool is online, returns -1 if it isn't
+static int enterSubmit(ThreadPool *tp) {
+    // a single atomic step, tpDestroy either sees the submitter or the submitter sees it's offline
+    if ((__atomic_add_fetch(&tp->state, TP_SUBMITTER, __ATOMIC_SEQ_CST) & TP_STATE_MASK) == ONLINE) {
+        return 0;
+    }
+
+    __atomic_sub_fetch(&tp->state, TP_SUBMITTER, __ATOMIC_SEQ_CST);
+    return -1;
+}
+
+
+// the function gets thread pool
+// it ends the caller's insert, the last submitter after tpDestroy started wakes it
+static void leaveSubmit(ThreadPool *tp) {
+    if (__atomic_sub_fetch(&tp->state, TP_SUBMITTER, __ATOMIC_SEQ_CST) == OFFLINE) {
+        futexWakeAll(&tp->state);
+    }
+}
+
+
+// the function gets clock, num of milliseconds and where to put the deadline
+// it sets the absolute time ms milliseconds from now
+static void deadlineAfter(clockid_t clock, long ms, struct timespec *deadline) {
+    clock_gettime(clock, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+
+// the function gets thread pool
+// it returns a free task, from the worker's cache if called by one of tp's workers
+static Task *allocTask(ThreadPool *tp) {
+    Worker *worker = currentWorker;
+    if (worker != NULL && worker->tp == tp && worker->freeCount > 0) {
+        return worker->freeTasks[--worker->freeCount];
+    }
+
+    Task *task = (Task *) osSlabAlloc(tp->taskSlab);
+    if (task == NULL) {
+        sys_error();
+    }
+
+    return task;
+}
+
+
+// the function gets thread pool and task
+// it keeps the task in the worker's cache or gives it back to the slab
+// the task's token loses a reference and the heap copy of its args is freed
+static void freeTask(ThreadPool *tp, Task *task) {
+    Worker *worker = currentWorker;
+
+    if (task->token != NULL) {
+        tpReleaseToken(task->token);
+    }
+    if (task->argSize > TP_TASK_INLINE) {
+        free(task->args);
+    }
+
+    if (worker == NULL || worker->tp != tp) {
+        osSlabFree(tp->taskSlab, task);
+        return;
+    }
+
+    // cache is full, give back half of it at once
+    if (worker->freeCount == TP_TASK_CACHE) {
+        worker->freeCount = TP_TASK_CACHE / 2;
+        osSlabFreeBatch(tp->taskSlab, (void **) &(worker->freeTasks[worker->freeCount]), TP_TASK_CACHE / 2);
+    }
+
+    worker->freeTasks[worker->freeCount++] = task;
+}
+
+
+// the function gets worker
+// it moves a batch of tasks from the queue to the worker's deque and returns one of them
+static Task *takeFromQueue(Worker *worker) {
+    ThreadPool *tp = worker->tp;
+    Task *batch[TP_BATCH_SIZE];
+    int n = 0;
+
+    // lock thread pool's mutex
+    if (pthread_mutex_lock(&(tp->mutex)) != 0) {
+        sys_error();
+    }
+
+    // take our share of the queue
+    long share = tp->queued / tp->threadNum + 1;
+    while (n < TP_BATCH_SIZE && n < share && !osIsQueueEmpty(tp->queue)) {
+        batch[n++] = (Task *) osDequeueNode(tp->queue);
+    }
+    __atomic_store_n(&tp->queued, tp->queued - n, __ATOMIC_RELAXED);
+
+    // push in reverse so the owner still pops in fifo order
+    int i;
+    for (i = n - 1; i > 0; --i) {
+        osPushBottom(worker->deque, batch[i]);
+    }
+
+    // unlock thread pool's mutex
+    if (pthread_mutex_unlock(&(tp->mutex)) != 0) {
+        sys_error();
+    }
+
+    return (n > 0) ? batch[0] : NULL;
+}
+
+
+// the function gets worker and ring of a sub-pool
+// it moves a batch of tasks from the ring to the worker's deque without locking
+static Task *takeFromRing(Worker *worker, OSRing *ring) {
+    ThreadPool *tp = worker->tp;
+    Task *batch[TP_BATCH_SIZE];
+    int n = 0;
+
+    // take our share of the ring
+    size_t share = osRingSize(ring) * (size_t) tp->nodeCount / (size_t) tp->threadNum + 1;
+    while (n < TP_BATCH_SIZE && (size_t) n < share) {
+        Task *task = (Task *) osRingDequeue(ring);
+        if (task == NULL) {
+            break;
+        }
+        batch[n++] = task;
+    }
+
+    // push in reverse so the owner still pops in fifo order
+    int i;
+    for (i = n - 1; i > 0; --i) {
+        osPushBottom(worker->deque, batch[i]);
+    }
+
+    return (n > 0) ? batch[0] : NULL;
+}
+
+
+// the function gets counter, value and whether other threads add to it too
+// it adds the value, with a plain store when the calling thread is the only writer, and returns the sum
+static unsigned long long statAdd(unsigned long long *counter, unsigned long long value, int isShared) {
+    if (isShared) {
+        return __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+    }
+
+    unsigned long long sum = __atomic_load_n(counter, __ATOMIC_RELAXED) + value;
+    __atomic_store_n(counter, sum, __ATOMIC_RELAXED);
+    return sum;
+}
+
+
+// the function gets num of nanoseconds
+// it returns the value's histogram bucket, by its power of two and then the quarter of it
+static int histogramBucket(unsigned long long ns) {
+    if (ns < 4) {
+        return (int) ns;
+    }
+
+    int power = 63 - __builtin_clzll(ns);
+    return (power - 1) * 4 + (int) ((ns >> (power - 2)) & 3);
+}
+
+
+// the function gets histogram, num of nanoseconds and whether other threads add to it too
+// it counts the value
+static void histogramAdd(TPHistogram *histogram, long long ns, int isShared) {
+    int bucket = histogramBucket((ns > 0) ? (unsigned long long) ns : 0);
+    statAdd(&histogram->counts[bucket], 1, isShared);
+    statAdd(&histogram->total, 1, isShared);
+}
+
+
+// the function gets thread pool and where to tell whether the slot is shared
+// it returns the statistics and trace slot of the calling thread
+static int currentSlot(ThreadPool *tp, int *isShared) {
+    Worker *worker = currentWorker;
+    *isShared = (worker == NULL || worker->tp != tp);
+
+    return (*isShared) ? tp->threadNum : worker->id;
+}
+
+
+// the function gets thread pool, kind, func and times of the event
+// it adds the event to the calling thread's trace ring
+static void traceEvent(ThreadPool *tp, int kind, void (*func)(void *), long long enqueueNs,
+                       long long startNs, long long endNs) {
+    int isShared;
+    TraceRing *ring = &(tp->traces[currentSlot(tp, &isShared)]);
+
+    // other threads share their ring, they reserve the place first
+    unsigned long long n;
+    if (isShared) {
+        n = __atomic_fetch_add(&ring->count, 1, __ATOMIC_RELAXED);
+    } else {
+        n = __atomic_load_n(&ring->count, __ATOMIC_RELAXED);
+    }
+
+    // readers skip the event until its seq says it's written
+    TraceEvent *event = &(ring->events[n % ring->capacity]);
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&event->enqueueNs, enqueueNs, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->startNs, startNs, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->endNs, endNs, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->func, func, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->kind, kind, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->seq, n + 1, __ATOMIC_RELEASE);
+
+    if (!isShared) {
+        __atomic_store_n(&ring->count, n + 1, __ATOMIC_RELEASE);
+    }
+}
+
+
+// the function gets worker
+// it empties the worker's next slot and returns the task that was in it
+static Task *takeNext(Worker *worker) {
+    if (__atomic_load_n(&worker->next, __ATOMIC_RELAXED) == NULL) {
+        return NULL;
+    }
+
+    return __atomic_exchange_n(&worker->next, NULL, __ATOMIC_ACQUIRE);
+}
+
+
+// the function gets worker and chain of tasks inserted by the worker's task
+// it puts the last task in the next slot and the ones before it on the deque, so the newest runs first
+static void pushLocal(Worker *worker, Task *first) {
+    while (first != NULL) {
+        // read next before another worker can take the task
+        Task *next = (Task *) first->node.next;
+
+        Task *older = __atomic_exchange_n(&worker->next, first, __ATOMIC_ACQ_REL);
+        if (older != NULL) {
+            osPushBottom(worker->deque, older);
+        }
+        first = next;
+    }
+}
+
+
+// the function gets worker and whether to steal on its own node or on the others
+// it tries to steal a task from the other workers, starting at a random victim
+static Task *steal(Worker *worker, int isLocal) {
+    ThreadPool *tp = worker->tp;
+    int start = (int) (rand_r(&(worker->seed)) % (unsigned int) tp->threadNum);
+
+    int i;
+    for (i = 0; i < tp->threadNum; ++i) {
+        Worker *victim = &(tp->workers[(start + i) % tp->threadNum]);
+        if (victim == worker || (victim->node == worker->node) != isLocal) {
+            continue;
+        }
+
+        Task *task = (Task *) osStealTop(victim->deque);
+        if (task == NULL) {
+            task = takeNext(victim);
+        }
+        if (task != NULL) {
+            if (tp->config.collectStats) {
+                statAdd(&worker->stats->counters.steals, 1, 0);
+            }
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+
+// the function gets worker
+// it returns the next normal task: own next slot and deque first, then the ring and the queue,
+// then the other deques, other sub-pools are the last resort
+static Task *findNormalTask(Worker *worker) {
+    ThreadPool *tp = worker->tp;
+
+    Task *task = takeNext(worker);
+    if (task == NULL) {
+        task = (Task *) osPopBottom(worker->deque);
+    }
+    if (task == NULL && tp->rings != NULL) {
+        task = takeFromRing(worker, tp->rings[worker->node]);
+    }
+    if (task == NULL && __atomic_load_n(&tp->queued, __ATOMIC_RELAXED) > 0) {
+        task = takeFromQueue(worker);
+    }
+    if (task == NULL) {
+        task = steal(worker, 1);
+    }
+
+    if (task == NULL && tp->nodeCount > 1) {
+        int i;
+        for (i = 1; task == NULL && i < tp->nodeCount; ++i) {
+            task = takeFromRing(worker, tp->rings[(worker->node + i) % tp->nodeCount]);
+        }
+        if (task == NULL) {
+            task = steal(worker, 0);
+        }
+    }
+
+    return task;
+}
+
+
+// the function gets thread pool
+// it takes a normal task for a thread that isn't one of tp's workers: ring, queue, then the deques
+static Task *takeNormalOutside(ThreadPool *tp) {
+    Task *task = NULL;
+
+    int i;
+    for (i = 0; task == NULL && tp->rings != NULL && i < tp->nodeCount; ++i) {
+        task = (Task *) osRingDequeue(tp->rings[i]);
+    }
+
+    if (task == NULL && __atomic_load_n(&tp->queued, __ATOMIC_RELAXED) > 0) {
+        if (pthread_mutex_lock(&(tp->mutex)) != 0) {
+            sys_error();
+        }
+
+        task = (Task *) osDequeueNode(tp->queue);
+        if (task != NULL) {
+            __atomic_store_n(&tp->queued, tp->queued - 1, __ATOMIC_RELAXED);
+        }
+
+        if (pthread_mutex_unlock(&(tp->mutex)) != 0) {
+            sys_error();
+        }
+    }
+
+    for (i = 0; task == NULL && i < tp->threadNum; ++i) {
+        task = (Task *) osStealTop(tp->workers[i].deque);
+        if (task == NULL) {
+            task = takeNext(&(tp->workers[i]));
+        }
+    }
+
+    return task;
+}
+
+
+// the function gets thread pool, num of tasks and how long to wait for room, TP_WAIT_FOREVER for no limit
+// it counts the tasks against the queue capacity, returns -1 if there was no room in time
+static int admitTasks(ThreadPool *tp, long n, long timeoutMs) {
+    long capacity = tp->config.queueCapacity;
+    if (capacity == 0) {
+        return 0;
+    }
+    if (n > capacity) {
+        return -1;
+    }
+
+    // a worker waiting on its own pool's queue may wait for itself, let it in over the limit
+    Worker *worker = currentWorker;
+    int isOverAllowed = (worker != NULL && worker->tp == tp && timeoutMs == TP_WAIT_FOREVER);
+
+    struct timespec deadline;
+    int hasDeadline = 0;
+
+    long occupied = __atomic_load_n(&tp->occupied, __ATOMIC_SEQ_CST);
+    while (1) {
+        if (occupied + n <= capacity || isOverAllowed) {
+            if (__atomic_compare_exchange_n(&tp->occupied, &occupied, occupied + n, 1,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                return 0;
+            }
+            continue;
+        }
+
+        if (timeoutMs == 0 || lifecycle(tp) != ONLINE) {
+            return -1;
+        }
+        if (timeoutMs != TP_WAIT_FOREVER && !hasDeadline) {
+            deadlineAfter(CLOCK_MONOTONIC, timeoutMs, &deadline);
+            hasDeadline = 1;
+        }
+
+        // workers free room before they check for waiters, so check again after registering
+        int seq = __atomic_load_n(&tp->spaceSeq, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&tp->spaceWaiters, 1, __ATOMIC_SEQ_CST);
+        occupied = __atomic_load_n(&tp->occupied, __ATOMIC_SEQ_CST);
+        int isTimedOut = 0;
+        if (occupied + n > capacity && lifecycle(tp) == ONLINE) {
+            isTimedOut = futexWait(&tp->spaceSeq, seq, hasDeadline ? &deadline : NULL);
+            occupied = __atomic_load_n(&tp->occupied, __ATOMIC_SEQ_CST);
+        }
+        __atomic_sub_fetch(&tp->spaceWaiters, 1, __ATOMIC_SEQ_CST);
+
+        if (isTimedOut) {
+            return -1;
+        }
+    }
+}
+
+
+// the function gets thread pool and num of tasks that left the queue
+// it gives their room back and wakes as many waiting producers
+static void releaseTasks(ThreadPool *tp, long n) {
+    if (tp->config.queueCapacity == 0) {
+        return;
+    }
+
+    __atomic_sub_fetch(&tp->occupied, n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tp->spaceWaiters, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_add_fetch(&tp->spaceSeq, 1, __ATOMIC_SEQ_CST);
+        futexWake(&tp->spaceSeq, (n < INT_MAX) ? (int) n : INT_MAX);
+    }
+}
+
+
+// the function gets thread pool and a level
+// it takes a task of a priority queue above the level, a task waiting longer than the aging comes first
+static Task *takeLevelTask(ThreadPool *tp, int above) {
+    long long agingNs = tp->config.priorityAgingMs * 1000000LL;
+    long long now = (agingNs > 0) ? nowNs() : 0;
+    Task *task = NULL;
+    int level = -1;
+
+    // lock level mutex
+    if (pthread_mutex_lock(&(tp->levelMutex)) != 0) {
+        sys_error();
+    }
+
+    unsigned int mask = tp->levelMask;
+
+    if (agingNs > 0) {
+        // oldest head that waited too long, whatever its level
+        long long oldest = now - agingNs;
+        unsigned int aged = mask;
+        while (aged != 0) {
+            int l = __builtin_ctz(aged);
+            Task *head = (Task *) tp->levels[l]->head;
+            if (head->enqueueNs < oldest) {
+                oldest = head->enqueueNs;
+                level = l;
+            }
+            aged &= aged - 1;
+        }
+
+        // normal tasks waited too long, let the caller take one of them first
+        long normal = __atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST) - tp->levelTasks;
+        if (level < 0 && above == TP_PRIORITY_NORMAL && normal > 0
+            && __atomic_load_n(&tp->lastNormalNs, __ATOMIC_RELAXED) < now - agingNs) {
+            mask = 0;
+        }
+    }
+
+    // highest level first
+    if (level < 0 && (mask & ((1u << above) - 1)) != 0) {
+        level = __builtin_ctz(mask & ((1u << above) - 1));
+    }
+
+    if (level >= 0) {
+        task = (Task *) osDequeueNode(tp->levels[level]);
+        tp->levelTasks--;
+        if (osIsQueueEmpty(tp->levels[level])) {
+            __atomic_store_n(&tp->levelMask, tp->levelMask & ~(1u << level), __ATOMIC_RELEASE);
+        }
+    }
+
+    // unlock level mutex
+    if (pthread_mutex_unlock(&(tp->levelMutex)) != 0) {
+        sys_error();
+    }
+
+    return task;
+}
+
+
+// the function gets thread pool and worker, NULL if the caller isn't one of tp's workers
+// it returns the next task: levels above normal, normal tasks, then the levels below
+static Task *takeAnyTask(ThreadPool *tp, Worker *worker) {
+    Task *task = NULL;
+
+    unsigned int levels = __atomic_load_n(&tp->levelMask, __ATOMIC_ACQUIRE);
+    if (levels != 0) {
+        task = takeLevelTask(tp, TP_PRIORITY_NORMAL);
+    }
+
+    if (task == NULL) {
+        task = (worker != NULL) ? findNormalTask(worker) : takeNormalOutside(tp);
+
+        // remember when normal tasks last ran, for aging against the other levels
+        if (task != NULL && levels != 0 && tp->config.priorityAgingMs > 0) {
+            __atomic_store_n(&tp->lastNormalNs, nowNs(), __ATOMIC_RELAXED);
+        }
+    }
+
+    if (task == NULL && levels != 0) {
+        task = takeLevelTask(tp, TP_PRIORITY_LEVELS);
+    }
+
+    if (task != NULL) {
+        __atomic_sub_fetch(&tp->pending, 1, __ATOMIC_SEQ_CST);
+        releaseTasks(tp, 1);
+    }
+
+    return task;
+}
+
+
+// the function gets task
+// it returns 1 if the task's token is cancelled or its deadline passed
+static int isTaskStale(Task *task) {
+    if (task->token != NULL && __atomic_load_n(&task->token->isCancelled, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+
+    return (task->deadlineNs != 0 && nowNs() > task->deadlineNs);
+}
+
+
+// the function gets thread pool and worker, NULL if the caller isn't one of tp's workers
+// it returns the next task to run, the stale ones on the way are dropped
+static Task *takeTask(ThreadPool *tp, Worker *worker) {
+    Task *task;
+
+    while ((task = takeAnyTask(tp, worker)) != NULL && isTaskStale(task)) {
+        dropTask(tp, task);
+    }
+
+    return task;
+}
+
+
+// the function gets worker
+// it returns the next task for the worker
+static Task *findTask(Worker *worker) {
+    return takeTask(worker->tp, worker);
+}
+
+
+// the function gets worker
+// it takes the worker out of the idle registry, returns 0 if a waker already did
+static int unregisterIdle(Worker *worker) {
+    ThreadPool *tp = worker->tp;
+
+    // lock idle mutex
+    if (pthread_mutex_lock(&(tp->idleMutex)) != 0) {
+        sys_error();
+    }
+
+    int isRegistered = (worker->idleIndex >= 0);
+    if (isRegistered) {
+        Worker *moved = tp->idle[tp->idleCount - 1];
+        tp->idle[worker->idleIndex] = moved;
+        moved->idleIndex = worker->idleIndex;
+        worker->idleIndex = -1;
+        __atomic_sub_fetch(&tp->idleCount, 1, __ATOMIC_SEQ_CST);
+    }
+
+    // unlock idle mutex
+    if (pthread_mutex_unlock(&(tp->idleMutex)) != 0) {
+        sys_error();
+    }
+
+    return isRegistered;
+}
+
+
+// the function gets worker that stayed idle for the idle timeout
+// it retires the worker if tp has more than its min threads, returns 1 if it did
+static int retire(Worker *worker) {
+    ThreadPool *tp = worker->tp;
+    int isRetired = 0;
+
+    // lock resize mutex
+    if (pthread_mutex_lock(&(tp->resizeMutex)) != 0) {
+        sys_error();
+    }
+
+    if (lifecycle(tp) == ONLINE && tp->liveThreads > tp->config.minThreads) {
+        __atomic_sub_fetch(&tp->liveThreads, 1, __ATOMIC_SEQ_CST);
+
+        // submitters check live threads after pending, so a task may have come for us
+        if (__atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST) > 0) {
+            __atomic_add_fetch(&tp->liveThreads, 1, __ATOMIC_SEQ_CST);
+        } else {
+            worker->status = TP_WORKER_EXITED;
+            isRetired = 1;
+        }
+    }
+
+    // unlock resize mutex
+    if (pthread_mutex_unlock(&(tp->resizeMutex)) != 0) {
+        sys_error();
+    }
+
+    return isRetired;
+}
+
+
+// the function gets worker that a waker posted
+// it counts the wakeup in the worker's statistics
+static void countWakeup(Worker *worker) {
+    if (worker->tp->config.collectStats) {
+        statAdd(&worker->stats->counters.wakeups, 1, 0);
+    }
+}
+
+
+// the function gets worker
+// it registers the worker as idle and blocks until a submitter or tpDestroy wakes it
+// an elastic pool's worker gives up after the idle timeout, returns 1 if it retired
+static int park(Worker *worker) {
+    ThreadPool *tp = worker->tp;
+
+    // lock idle mutex
+    if (pthread_mutex_lock(&(tp->idleMutex)) != 0) {
+        sys_error();
+    }
+
+    worker->idleIndex = tp->idleCount;
+    tp->idle[tp->idleCount] = worker;
+    __atomic_add_fetch(&tp->idleCount, 1, __ATOMIC_SEQ_CST);
+
+    // unlock idle mutex
+    if (pthread_mutex_unlock(&(tp->idleMutex)) != 0) {
+        sys_error();
+    }
+
+    // submitters add to pending before they check for idle workers, so check again
+    if (__atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST) > 0
+        || lifecycle(tp) != ONLINE) {
+        // still registered, leave without waiting
+        if (unregisterIdle(worker)) {
+            return 0;
+        }
+    }
+
+    // block on own semaphore, whoever unregistered us posts it
+    if (tp->config.idleTimeoutMs == 0) {
+        while (sem_wait(&(worker->wakeup)) != 0) {
+            if (errno != EINTR) {
+                sys_error();
+            }
+        }
+        countWakeup(worker);
+        return 0;
+    }
+
+    struct timespec deadline;
+    deadlineAfter(CLOCK_MONOTONIC, tp->config.idleTimeoutMs, &deadline);
+
+    while (sem_clockwait(&(worker->wakeup), CLOCK_MONOTONIC, &deadline) != 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != ETIMEDOUT) {
+            sys_error();
+        }
+
+        // a waker unregistered us in the meantime, take its post
+        if (!unregisterIdle(worker)) {
+            while (sem_wait(&(worker->wakeup)) != 0) {
+                if (errno != EINTR) {
+                    sys_error();
+                }
+            }
+            countWakeup(worker);
+            return 0;
+        }
+
+        return retire(worker);
+    }
+
+    countWakeup(worker);
+    return 0;
+}
+
+
+// the function gets thread pool and whether to wait for a concurrent resize
+// it starts a worker in a free slot, returns -1 if tp is full, going down or busy resizing
+static int spawnWorker(ThreadPool *tp, int shouldWait) {
+    int result = -1;
+
+    // lock resize mutex, a submitter does not queue up behind another one's spawn
+    if (shouldWait) {
+        if (pthread_mutex_lock(&(tp->resizeMutex)) != 0) {
+            sys_error();
+        }
+    } else if (pthread_mutex_trylock(&(tp->resizeMutex)) != 0) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < tp->threadNum && lifecycle(tp) == ONLINE
+         && tp->liveThreads < tp->threadNum; ++i) {
+        Worker *worker = &(tp->workers[i]);
+        if (worker->status == TP_WORKER_RUNNING) {
+            continue;
+        }
+
+        // a retired worker may still be on its way out
+        if (worker->status == TP_WORKER_EXITED && pthread_join(tp->threads[i], NULL) != 0) {
+            sys_error();
+        }
+
+        worker->status = TP_WORKER_RUNNING;
+        worker->freeCount = 0;
+        worker->idleIndex = -1;
+        __atomic_add_fetch(&tp->liveThreads, 1, __ATOMIC_SEQ_CST);
+
+        if (pthread_create(&(tp->threads[i]), NULL, exec, (void *) worker) != 0) {
+            worker->status = TP_WORKER_NONE;
+            __atomic_sub_fetch(&tp->liveThreads, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+
+        result = 0;
+        break;
+    }
+
+    // unlock resize mutex
+    if (pthread_mutex_unlock(&(tp->resizeMutex)) != 0) {
+        sys_error();
+    }
+
+    return result;
+}
+
+
+// the function gets thread pool
+// it starts one more worker of an elastic pool when no worker is left or the backlog is deep
+static void growIfBacklogged(ThreadPool *tp) {
+    int liveThreads = __atomic_load_n(&tp->liveThreads, __ATOMIC_SEQ_CST);
+
+    if (liveThreads < tp->threadNum
+        && (liveThreads == 0 || __atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST) >= tp->config.growQueueDepth)) {
+        spawnWorker(tp, liveThreads == 0);
+    }
+}
+
+
+// the function gets thread pool and max num of workers to wake
+// it unregisters up to n idle workers, most recently parked first, posts them and returns how many
+static long wakeWorkers(ThreadPool *tp, long n) {
+    Worker *woken[TP_BATCH_SIZE];
+    long total = 0;
+
+    while (n > 0 && __atomic_load_n(&tp->idleCount, __ATOMIC_SEQ_CST) > 0) {
+        int k = 0;
+
+        // lock idle mutex
+        if (pthread_mutex_lock(&(tp->idleMutex)) != 0) {
+            sys_error();
+        }
+
+        while (k < n && k < TP_BATCH_SIZE && tp->idleCount > 0) {
+            Worker *worker = tp->idle[tp->idleCount - 1];
+            worker->idleIndex = -1;
+            __atomic_sub_fetch(&tp->idleCount, 1, __ATOMIC_SEQ_CST);
+            woken[k++] = worker;
+        }
+
+        // unlock idle mutex
+        if (pthread_mutex_unlock(&(tp->idleMutex)) != 0) {
+            sys_error();
+        }
+
+        int i;
+        for (i = 0; i < k; ++i) {
+            if (sem_post(&(woken[i]->wakeup)) != 0) {
+                sys_error();
+            }
+        }
+        n -= k;
+        total += k;
+    }
+
+    return total;
+}
+
+
+// the function gets path of a sysfs cpu list like 0-3,8,10-11, node and cpu table
+// it sets the node of the listed cpus we may run on, returns how many
+static int readCpuList(const char *path, int node, int *cpuNode) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    int count = 0;
+    int first, last;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(file);
+        if (c == '-') {
+            if (fscanf(file, "%d", &last) != 1) {
+                break;
+            }
+            c = fgetc(file);
+        }
+
+        int cpu;
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            if (cpu >= 0 && cpuNode[cpu] == 0) {
+                cpuNode[cpu] = node;
+                ++count;
+            }
+        }
+
+        if (c != ',') {
+            break;
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+
+// the function gets a table with an entry per cpu
+// it fills in the numa node of every cpu we may run on and returns num of nodes, at least 1
+static int readNodes(int *cpuNode) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        sys_error();
+    }
+
+    // 0 marks a cpu of no node yet, nodes are counted from 1 while reading
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        cpuNode[cpu] = CPU_ISSET(cpu, &allowed) ? 0 : -1;
+    }
+
+    int nodeCount = 0;
+    int id;
+    for (id = 0; id < TP_MAX_NODES; ++id) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        if (readCpuList(path, nodeCount + 1, cpuNode) > 0) {
+            ++nodeCount;
+        }
+    }
+
+    // cpus no node listed go to the first one
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (cpuNode[cpu] > 0) {
+            cpuNode[cpu]--;
+        }
+    }
+
+    return (nodeCount > 0) ? nodeCount : 1;
+}
+
+
+// the function gets config
+// it checks the placement, the cpus of a cpu list must be ones we may run on
+static int isPlacementValid(const TPConfig *config) {
+    if (config->placement < TP_PLACEMENT_NONE || config->placement > TP_PLACEMENT_NUMA) {
+        return 0;
+    }
+    if (config->placement != TP_PLACEMENT_LIST) {
+        return 1;
+    }
+    if (config->cpus == NULL || config->cpuCount < 1) {
+        return 0;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        sys_error();
+    }
+
+    int i;
+    for (i = 0; i < config->cpuCount; ++i) {
+        int cpu = config->cpus[i];
+        if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+// the function gets thread pool
+// it picks the cpu or the node of every worker slot by tp's placement
+static void placeWorkers(ThreadPool *tp) {
+    placement placement = tp->config.placement;
+    int i;
+
+    if (placement == TP_PLACEMENT_NONE) {
+        return;
+    }
+
+    if (placement == TP_PLACEMENT_LIST) {
+        for (i = 0; i < tp->threadNum; ++i) {
+            tp->workers[i].cpu = tp->config.cpus[i % tp->config.cpuCount];
+        }
+        return;
+    }
+
+    // a sub-pool per node, workers go round robin over the nodes
+    if (placement == TP_PLACEMENT_NUMA) {
+        for (i = 0; i < tp->threadNum; ++i) {
+            tp->workers[i].node = i % tp->nodeCount;
+        }
+        return;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        sys_error();
+    }
+
+    // compact takes the cpus in order, scatter takes the next cpu of every node in turn
+    int *order = (int *) malloc(sizeof(int) * CPU_SETSIZE);
+    if (order == NULL) {
+        sys_error();
+    }
+    int count = 0;
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            order[count++] = cpu;
+        }
+    }
+
+    if (placement == TP_PLACEMENT_SCATTER) {
+        int n = 0;
+        int round;
+        for (round = 0; n < count; ++round) {
+            int node;
+            for (node = 0; node < TP_MAX_NODES; ++node) {
+                // round-th cpu of the node
+                int seen = 0;
+                for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                    if (tp->cpuNode[cpu] == node && seen++ == round) {
+                        order[n++] = cpu;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < tp->threadNum; ++i) {
+        tp->workers[i].cpu = order[i % count];
+    }
+    free(order);
+}
+
+
+// the function gets worker
+// it pins the calling worker thread to its cpu, or to the cpus of its node
+static void pinWorker(Worker *worker) {
+    ThreadPool *tp = worker->tp;
+
+    if (tp->config.placement == TP_PLACEMENT_NONE) {
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (worker->cpu >= 0) {
+        CPU_SET(worker->cpu, &cpus);
+    } else {
+        int cpu;
+        for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (tp->cpuNode[cpu] == worker->node) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+    }
+
+    // pinning is best effort, a worker that can't be pinned runs unpinned
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        worker->cpu = -1;
+    }
+}
+
+
+// the function measures how long one idle spin takes
+static long measureSpinNs() {
+    long long start = nowNs();
+
+    int i;
+    for (i = 0; i < 1000; ++i) {
+        TP_CPU_RELAX();
+    }
+
+    long spinNs = (long) ((nowNs() - start) / 1000);
+    return (spinNs > 0) ? spinNs : 1;
+}
+
+
+// the function gets worker
+// it spins and then yields while waiting for work, returns 1 if work showed up before parking
+static int spinForWork(Worker *worker) {
+    ThreadPool *tp = worker->tp;
+    long spins = tp->config.idleSpins;
+    int yields = tp->config.idleYields;
+
+    // spin about twice the time between submissions, park at once if they are further apart
+    if (tp->config.adaptiveSpin) {
+        long arrivalNs = __atomic_load_n(&tp->arrivalNs, __ATOMIC_RELAXED);
+        long budget = 2 * (arrivalNs / worker->spinNs);
+        if (budget > spins) {
+            spins = 0;
+            yields = 0;
+        } else {
+            spins = budget;
+        }
+    }
+    if (spins == 0 && yields == 0) {
+        return 0;
+    }
+
+    __atomic_add_fetch(&tp->spinning, 1, __ATOMIC_SEQ_CST);
+
+    int hasWork = 0;
+    long long start = nowNs();
+    long i;
+    for (i = 0; i < spins && !hasWork; ++i) {
+        TP_CPU_RELAX();
+        hasWork = (__atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST) > 0
+                   || lifecycle(tp) != ONLINE);
+    }
+
+    // learn how long a spin takes on this cpu
+    if (i > 0) {
+        long spinNs = (long) ((nowNs() - start) / i);
+        worker->spinNs += (spinNs - worker->spinNs) / 8;
+        if (worker->spinNs < 1) {
+            worker->spinNs = 1;
+        }
+    }
+
+    int j;
+    for (j = 0; j < yields && !hasWork; ++j) {
+        sched_yield();
+        hasWork = (__atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST) > 0
+                   || lifecycle(tp) != ONLINE);
+    }
+
+    __atomic_sub_fetch(&tp->spinning, 1, __ATOMIC_SEQ_CST);
+
+    // submitters did not wake anyone while we spun, pass the extra work on
+    if (hasWork && __atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST) > 1) {
+        wakeWorkers(tp, 1);
+    }
+
+    return hasWork;
+}
+
+
+// the function gets thread pool and num of new tasks
+// it wakes idle workers for the tasks spinning workers will not pick up, an elastic pool may grow
+static void wakeForTasks(ThreadPool *tp, long n) {
+    n -= __atomic_load_n(&tp->spinning, __ATOMIC_SEQ_CST);
+    if (n > 0) {
+        n -= wakeWorkers(tp, n);
+    }
+
+    // nobody is free to take the tasks
+    if (n > 0 && tp->config.minThreads < tp->threadNum) {
+        growIfBacklogged(tp);
+    }
+}
+
+
+// the function gets thread pool and num of tasks that are done
+// it wakes tpWaitIdle callers when the last task in flight is done
+static void finishTasks(ThreadPool *tp, int n) {
+    if (__atomic_sub_fetch(&tp->inFlight, n, __ATOMIC_SEQ_CST) == 0
+        && __atomic_load_n(&tp->idleWaiters, __ATOMIC_SEQ_CST) > 0) {
+        futexWakeAll(&tp->inFlight);
+    }
+}
+
+
+// the function gets group
+// it counts one of the group's tasks as done and wakes the waiters after the last one
+static void finishGroup(TPGroup *group) {
+    if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        futexWakeAll(&group->pending);
+    }
+}
+
+
+// the function gets thread pool and task
+// it runs the task and recycles it
+static void runTask(ThreadPool *tp, Task *task) {
+    int isSampled = 0;
+    int isShared;
+    WorkerStats *stats = NULL;
+
+    // reading the clock costs as much as a short task, so only a sample of the tasks is timed
+    if (tp->config.collectStats) {
+        stats = &(tp->stats[currentSlot(tp, &isShared)]);
+        isSampled = (statAdd(&stats->counters.executed, 1, isShared) % TP_STATS_SAMPLE == 0);
+    }
+
+    // a traced pool times every task
+    if (!isSampled && tp->traces == NULL) {
+        ((task->func))(task->args);
+    } else {
+        void (*func)(void *) = task->func;
+        long long enqueueNs = task->enqueueNs;
+        long long start = nowNs();
+
+        ((task->func))(task->args);
+
+        long long end = nowNs();
+        if (isSampled) {
+            histogramAdd(&stats->queueWait, start - enqueueNs, isShared);
+            histogramAdd(&stats->runTime, end - start, isShared);
+        }
+        if (tp->traces != NULL) {
+            traceEvent(tp, TP_TRACE_TASK, func, enqueueNs, start, end);
+        }
+    }
+
+    if (task->group != NULL) {
+        finishGroup(task->group);
+    }
+    freeTask(tp, task);
+    finishTasks(tp, 1);
+}
+
+
+// the function gets worker as void
+// it does the tasks while tp running or waiting to tasks in queue
+static void *exec(void *x) {
+    // try to convert to worker
+    Worker *worker = (Worker *) x;
+    if (worker == NULL) {
+        sys_error();
+    }
+    ThreadPool *tp = worker->tp;
+    currentWorker = worker;
+    worker->lastNs = nowNs();
+    pinWorker(worker);
+
+    while (1) {
+        // do task
+        Task *task = findTask(worker);
+        if (task != NULL) {
+            // task waited too long while every worker was busy
+            if (tp->config.minThreads < tp->threadNum
+                && __atomic_load_n(&tp->idleCount, __ATOMIC_RELAXED) == 0
+                && nowNs() - task->enqueueNs > tp->config.growWaitMs * 1000000LL) {
+                growIfBacklogged(tp);
+            }
+
+            runTask(tp, task);
+            continue;
+        }
+
+        // some task is still in a deque we lost a race on, try again
+        if (__atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST) > 0) {
+            sched_yield();
+            continue;
+        }
+
+        // tp is offline and no task left, a submitter still inside an insert may add one
+        if (lifecycle(tp) == OFFLINE) {
+            if (__atomic_load_n(&tp->state, __ATOMIC_SEQ_CST) == OFFLINE
+                && __atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST) == 0) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+
+        // the worker was busy since it last woke, now it's idle until it finds work
+        int isTimed = (tp->config.collectStats || tp->traces != NULL);
+        long long idleStart = isTimed ? nowNs() : 0;
+        if (tp->config.collectStats) {
+            statAdd(&worker->stats->counters.busyNs, (unsigned long long) (idleStart - worker->lastNs), 0);
+        }
+        int isRetired = (!spinForWork(worker) && park(worker));
+        if (isTimed) {
+            worker->lastNs = nowNs();
+        }
+        if (tp->config.collectStats) {
+            statAdd(&worker->stats->counters.idleNs, (unsigned long long) (worker->lastNs - idleStart), 0);
+        }
+        if (tp->traces != NULL) {
+            traceEvent(tp, TP_TRACE_IDLE, NULL, 0, idleStart, worker->lastNs);
+        }
+        if (isRetired) {
+            break;
+        }
+    }
+
+    if (tp->config.collectStats) {
+        statAdd(&worker->stats->counters.busyNs, (unsigned long long) (nowNs() - worker->lastNs), 0);
+    }
+
+    // give back cached tasks
+    osSlabFreeBatch(tp->taskSlab, (void **) worker->freeTasks, worker->freeCount);
+    worker->freeCount = 0;
+    currentWorker = NULL;
+
+    pthread_exit(NULL);
+}
+
+
+// the function gets num of threads
+// it creates and returns a thread pull with this num of threads
+ThreadPool *tpCreate(int threadNum) {
+    TPConfig config;
+    tpConfigInit(&config, threadNum);
+
+    return tpCreateWithConfig(&config);
+}
+
+
+// the function gets config and num of threads
+// it sets the default options
+void tpConfigInit(TPConfig *config, int threadNum) {
+    config->threadNum = threadNum;
+    config->ringCapacity = 0;
+    config->taskSlabCapacity = 1024;
+    config->idleSpins = 2048;
+    config->idleYields = 2;
+    config->adaptiveSpin = 1;
+    config->handleSlabCapacity = 256;
+    config->priorityAgingMs = 0;
+    config->minThreads = threadNum;
+    config->idleTimeoutMs = 0;
+    config->growQueueDepth = 64;
+    config->growWaitMs = 10;
+    config->placement = TP_PLACEMENT_NONE;
+    config->cpus = NULL;
+    config->cpuCount = 0;
+    config->queueCapacity = 0;
+    config->collectStats = 1;
+    config->traceEvents = 0;
+    config->timerTickUs = 1000;
+    config->periodicOverrun = TP_OVERRUN_SKIP;
+}
+
+
+// the function gets min and max num of threads and idle timeout
+// it creates and returns a thread pull that grows under load and shrinks back when idle
+ThreadPool *tpCreateElastic(int minThreads, int maxThreads, long idleTimeoutMs) {
+    TPConfig config;
+    tpConfigInit(&config, maxThreads);
+    config.minThreads = minThreads;
+    config.idleTimeoutMs = idleTimeoutMs;
+
+    return tpCreateWithConfig(&config);
+}
+
+
+// the function gets config
+// it creates and returns a thread pull with these options
+ThreadPool *tpCreateWithConfig(const TPConfig *config) {
+    int threadNum = config->threadNum;
+
+    // case no positive num threads
+    if (threadNum < 1 || config->ringCapacity < 0 || config->taskSlabCapacity < 0
+        || config->idleSpins < 0 || config->idleYields < 0 || config->handleSlabCapacity < 0
+        || config->priorityAgingMs < 0 || config->minThreads < 0 || config->minThreads > threadNum
+        || config->idleTimeoutMs < 0 || config->growQueueDepth < 1 || config->growWaitMs < 0
+        || config->queueCapacity < 0 || config->traceEvents < 0 || config->timerTickUs < 1
+        || config->periodicOverrun < TP_OVERRUN_SKIP || config->periodicOverrun > TP_OVERRUN_COALESCE
+        || !isPlacementValid(config)) {
+        return NULL;
+    }
+
+    // else try to create thread pool
+    ThreadPool *tp = (ThreadPool *) malloc(sizeof(ThreadPool));
+    if (tp == NULL) {
+        sys_error();
+    }
+
+    // set thread pool's fields
+    tp->config = *config;
+    tp->state = ONLINE;
+    tp->threadNum = threadNum;
+    tp->queue = osCreateQueue();
+    tp->queued = 0;
+    tp->pending = 0;
+    tp->inFlight = 0;
+    tp->idleWaiters = 0;
+    tp->idleCount = 0;
+    tp->spinning = 0;
+    tp->lastArrival = nowNs();
+    tp->arrivalNs = TP_MAX_ARRIVAL_NS;
+    tp->liveThreads = 0;
+    tp->occupied = 0;
+    tp->spaceSeq = 0;
+    tp->spaceWaiters = 0;
+
+    // try to create tasks' slab
+    tp->taskSlab = osCreateSlab(sizeof(Task), (unsigned int) config->taskSlabCapacity);
+    if (tp->taskSlab == NULL) {
+        free(tp);
+        sys_error();
+    }
+
+    // try to create handles' slab
+    tp->handleSlab = osCreateSlab(sizeof(TPHandle), (unsigned int) config->handleSlabCapacity);
+    if (tp->handleSlab == NULL) {
+        free(tp);
+        sys_error();
+    }
+
+    // try to read the numa nodes, every one is a sub-pool with numa placement
+    tp->nodeCount = 1;
+    tp->cpuNode = NULL;
+    if (config->placement == TP_PLACEMENT_SCATTER || config->placement == TP_PLACEMENT_NUMA) {
+        tp->cpuNode = (int *) malloc(sizeof(int) * CPU_SETSIZE);
+        if (tp->cpuNode == NULL) {
+            free(tp);
+            sys_error();
+        }
+        int nodeCount = readNodes(tp->cpuNode);
+        tp->nodeCount = (config->placement == TP_PLACEMENT_NUMA) ? nodeCount : 1;
+    }
+
+    // try to create rings, one per sub-pool
+    tp->rings = NULL;
+    if (config->ringCapacity > 0 || tp->nodeCount > 1) {
+        size_t capacity = (config->ringCapacity > 0) ? (size_t) config->ringCapacity : TP_NODE_RING_CAPACITY;
+        tp->rings = (OSRing **) malloc(sizeof(OSRing *) * (size_t) tp->nodeCount);
+        if (tp->rings == NULL) {
+            free(tp);
+            sys_error();
+        }
+        int node;
+        for (node = 0; node < tp->nodeCount; ++node) {
+            tp->rings[node] = osCreateRing(capacity);
+            if (tp->rings[node] == NULL) {
+                free(tp);
+                sys_error();
+            }
+        }
+    }
+
+    // try to init mutex
+    if (pthread_mutex_init(&(tp->mutex), NULL) != 0) {
+        free(tp);
+        sys_error();
+    }
+
+    // try to create priority queues and init level mutex
+    int level;
+    for (level = 0; level < TP_PRIORITY_LEVELS; ++level) {
+        tp->levels[level] = (level != TP_PRIORITY_NORMAL) ? osCreateQueue() : NULL;
+        if (level != TP_PRIORITY_NORMAL && tp->levels[level] == NULL) {
+            sys_error();
+        }
+    }
+    tp->levelMask = 0;
+    tp->levelTasks = 0;
+    tp->lastNormalNs = 0;
+    if (pthread_mutex_init(&(tp->levelMutex), NULL) != 0) {
+        free(tp);
+        sys_error();
+    }
+
+    // try to create buckets for the keyed tasks' strands, a few per thread keeps their mutexes apart
+    tp->strandBucketCount = 16;
+    while (tp->strandBucketCount < 4 * (unsigned int) config->threadNum) {
+        tp->strandBucketCount *= 2;
+    }
+    if (posix_memalign((void **) &(tp->strandBuckets), OS_CACHE_LINE,
+                       sizeof(StrandBucket) * tp->strandBucketCount) != 0) {
+        sys_error();
+    }
+    unsigned int bucket;
+    for (bucket = 0; bucket < tp->strandBucketCount; ++bucket) {
+        tp->strandBuckets[bucket].strands = NULL;
+        tp->strandBuckets[bucket].free = NULL;
+        if (pthread_mutex_init(&(tp->strandBuckets[bucket].mutex), NULL) != 0) {
+            sys_error();
+        }
+    }
+
+    // try to create timer wheel, init timer mutex and a condition on the monotonic clock
+    tp->wheel = osCreateWheel(0);
+    tp->timerChunks = NULL;
+    tp->timerChunkCount = 0;
+    tp->timerFree = TP_TIMER_NONE;
+    tp->hasTimerThread = 0;
+    tp->isTimerStopping = 0;
+    tp->timerStartNs = nowNs();
+    tp->timerWakeTick = -1;
+    pthread_condattr_t timerCondAttr;
+    if (tp->wheel == NULL || pthread_mutex_init(&(tp->timerMutex), NULL) != 0
+        || pthread_condattr_init(&timerCondAttr) != 0
+        || pthread_condattr_setclock(&timerCondAttr, CLOCK_MONOTONIC) != 0
+        || pthread_cond_init(&(tp->timerCond), &timerCondAttr) != 0
+        || pthread_condattr_destroy(&timerCondAttr) != 0) {
+        free(tp);
+        sys_error();
+    }
+
+    // reactor starts with the first watch
+    tp->epollFd = -1;
+    tp->reactorStopFd = -1;
+    tp->hasReactor = 0;
+    tp->isReactorStopping = 0;
+    tp->watches = NULL;
+    tp->watchCapacity = 0;
+    if (pthread_mutex_init(&(tp->reactorMutex), NULL) != 0) {
+        free(tp);
+        sys_error();
+    }
+
+    // try to init idle and resize mutexes
+    if (pthread_mutex_init(&(tp->idleMutex), NULL) != 0
+        || pthread_mutex_init(&(tp->resizeMutex), NULL) != 0) {
+        free(tp);
+        sys_error();
+    }
+
+    // try to alloc threads
+    int threadsSize = sizeof(pthread_t) * (size_t) threadNum;
+    tp->threads = (pthread_t *) malloc(threadsSize);
+    if (tp->threads == NULL) {
+        free(tp);
+        sys_error();
+    }
+
+    // try to alloc workers, their deques and the idle registry
+    tp->workers = (Worker *) malloc(sizeof(Worker) * (size_t) threadNum);
+    tp->idle = (Worker **) malloc(sizeof(Worker *) * (size_t) threadNum);
+    if (tp->workers == NULL || tp->idle == NULL) {
+        free(tp->threads);
+        free(tp);
+        sys_error();
+    }
+
+    int i;
+
+    // try to alloc statistics, a slot per worker and one for the other threads
+    size_t statsSize = sizeof(WorkerStats) * (size_t) (threadNum + 1);
+    if (posix_memalign((void **) &(tp->stats), OS_CACHE_LINE, statsSize) != 0) {
+        free(tp->threads);
+        free(tp);
+        sys_error();
+    }
+    memset(tp->stats, 0, statsSize);
+
+    // try to alloc trace rings, the same slots as the statistics
+    tp->traces = NULL;
+    tp->traceStartNs = nowNs();
+    if (config->traceEvents > 0) {
+        size_t tracesSize = sizeof(TraceRing) * (size_t) (threadNum + 1);
+        if (posix_memalign((void **) &(tp->traces), OS_CACHE_LINE, tracesSize) != 0) {
+            sys_error();
+        }
+        for (i = 0; i <= threadNum; ++i) {
+            tp->traces[i].events = (TraceEvent *) calloc((size_t) config->traceEvents, sizeof(TraceEvent));
+            if (tp->traces[i].events == NULL) {
+                sys_error();
+            }
+            tp->traces[i].capacity = (unsigned long) config->traceEvents;
+            tp->traces[i].count = 0;
+        }
+    }
+
+    long spinNs = measureSpinNs();
+    for (i = 0; i < threadNum; ++i) {
+        tp->workers[i].tp = tp;
+        tp->workers[i].id = i;
+        tp->workers[i].seed = (unsigned int) i + 1;
+        tp->workers[i].next = NULL;
+        tp->workers[i].freeCount = 0;
+        tp->workers[i].idleIndex = -1;
+        tp->workers[i].spinNs = spinNs;
+        tp->workers[i].status = TP_WORKER_NONE;
+        tp->workers[i].cpu = -1;
+        tp->workers[i].node = 0;
+        tp->workers[i].stats = &(tp->stats[i]);
+        tp->workers[i].deque = osCreateDeque();
+        if (tp->workers[i].deque == NULL || sem_init(&(tp->workers[i].wakeup), 0, 0) != 0) {
+            sys_error();
+        }
+    }
+
+    placeWorkers(tp);
+
+    // try to create min threads, an elastic pool starts the others when needed
+    for (i = 0; i < config->minThreads; ++i) {
+        if (spawnWorker(tp, 1) != 0) {
+            tpDestroy(tp, 0);
+            sys_error();
+        }
+    }
+
+    return tp;
+}
+
+
+// the function gets thread pool
+// it returns the sub-pool of the calling thread, the one of its cpu unless it's one of tp's workers
+static int submitNode(ThreadPool *tp) {
+    if (tp->nodeCount == 1) {
+        return 0;
+    }
+
+    Worker *worker = currentWorker;
+    if (worker != NULL && worker->tp == tp) {
+        return worker->node;
+    }
+
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= CPU_SETSIZE || tp->cpuNode[cpu] < 0) {
+        return 0;
+    }
+
+    return tp->cpuNode[cpu];
+}
+
+
+// the function gets thread pool and a chain of n tasks, already counted in flight
+// it inserts the tasks to the ring and the queue, where every worker takes them in order, and wakes workers
+static void enqueueShared(ThreadPool *tp, Task *first, Task *last, long n) {
+    long total = n;
+
+    // insert tasks to ring without locking, a full ring overflows to the queue
+    if (tp->rings != NULL) {
+        OSRing *ring = tp->rings[submitNode(tp)];
+        long added = 0;
+        while (first != NULL) {
+            // read next before a worker can take the task
+            Task *next = (Task *) first->node.next;
+            if (osRingEnqueue(ring, first) != 0) {
+                break;
+            }
+            first = next;
+            ++added;
+        }
+
+        if (added > 0) {
+            __atomic_add_fetch(&tp->pending, added, __ATOMIC_SEQ_CST);
+            n -= added;
+        }
+
+        if (first == NULL) {
+            wakeForTasks(tp, total);
+            return;
+        }
+    }
+
+    // lock thread pool's mutex
+    if (pthread_mutex_lock(&(tp->mutex)) != 0) {
+        sys_error();
+    }
+
+    // insert tasks to queue
+    osEnqueueChain(tp->queue, &(first->node), &(last->node));
+    __atomic_store_n(&tp->queued, tp->queued + n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&tp->pending, n, __ATOMIC_SEQ_CST);
+
+    // unlock thread pool's mutex
+    if (pthread_mutex_unlock(&(tp->mutex)) != 0) {
+        sys_error();
+    }
+
+    // wake one idle worker per task, none if all are busy
+    wakeForTasks(tp, total);
+}
+
+
+// the function gets thread pool and a chain of n tasks
+// it inserts the tasks to the ring and the queue and wakes workers for them
+static void enqueueTasks(ThreadPool *tp, Task *first, Task *last, long n) {
+    // count the tasks before any worker can finish them
+    __atomic_add_fetch(&tp->inFlight, (int) n, __ATOMIC_SEQ_CST);
+
+    // keep the average time between submissions for spinning workers
+    // every thread samples one of its submissions, so the samples come TP_ARRIVAL_SAMPLE submissions apart
+    if (tp->config.adaptiveSpin && ++submitCount % TP_ARRIVAL_SAMPLE == 0) {
+        long long now = first->enqueueNs;
+        long long previous = __atomic_exchange_n(&tp->lastArrival, now, __ATOMIC_RELAXED);
+        long arrivalNs = __atomic_load_n(&tp->arrivalNs, __ATOMIC_RELAXED);
+        long long span = (now - previous) / TP_ARRIVAL_SAMPLE;
+        long gap = (span < TP_MAX_ARRIVAL_NS) ? (long) span : TP_MAX_ARRIVAL_NS;
+        __atomic_store_n(&tp->arrivalNs, arrivalNs + (gap - arrivalNs) / 8, __ATOMIC_RELAXED);
+    }
+
+    // tasks inserted by a running task stay on its worker, where their data is still in cache
+    Worker *worker = currentWorker;
+    if (worker != NULL && worker->tp == tp) {
+        pushLocal(worker, first);
+        __atomic_add_fetch(&tp->pending, n, __ATOMIC_SEQ_CST);
+        wakeForTasks(tp, n);
+        return;
+    }
+
+    enqueueShared(tp, first, last, n);
+}
+
+
+// the function gets thread pool, funcs or a single func, args, n, how long to wait for room,
+// and a task whose token, deadline and group the new ones copy, NULL for none
+// the token must already hold a reference for each task
+// it links n tasks into a chain and inserts them at once
+static int insertTasks(ThreadPool *tp, void (**computeFuncs)(void *), void (*computeFunc)(void *),
+                       void **args, int n, long timeoutMs, const Task *proto) {
+    if (n < 0) {
+        return -1;
+    }
+
+    // case thread pool isn't running
+    if (enterSubmit(tp) != 0) {
+        return -1;
+    }
+    if (n == 0) {
+        leaveSubmit(tp);
+        return 0;
+    }
+
+    // case queue is full
+    if (admitTasks(tp, n, timeoutMs) != 0) {
+        leaveSubmit(tp);
+        return -1;
+    }
+
+    Task *first = NULL, *last = NULL;
+    long long now = nowNs();
+    int i;
+    for (i = 0; i < n; ++i) {
+        // take a task from the slab
+        Task *task = allocTask(tp);
+
+        // set task's func and args
+        task->args = args[i];
+        task->func = (computeFuncs != NULL) ? computeFuncs[i] : computeFunc;
+        task->enqueueNs = now;
+        task->token = (proto != NULL) ? proto->token : NULL;
+        task->deadlineNs = (proto != NULL) ? proto->deadlineNs : 0;
+        task->group = (proto != NULL) ? proto->group : NULL;
+        task->argSize = (proto != NULL) ? proto->argSize : 0;
+        task->node.next = NULL;
+
+        // args copied for the task fit in it, or are a heap copy the task owns
+        if (task->argSize > 0 && task->argSize <= TP_TASK_INLINE) {
+            memcpy(task->inlineArgs, args[i], task->argSize);
+            task->args = task->inlineArgs;
+        }
+
+        if (first == NULL) {
+            first = task;
+        } else {
+            last->node.next = &(task->node);
+        }
+        last = task;
+    }
+
+    enqueueTasks(tp, first, last, n);
+    leaveSubmit(tp);
+
+    return 0;
+}
+
+
+// the function gets thread pool, func and args
+// it inserts the func and args as task to the thread pool
+int tpInsertTask(ThreadPool *tp, void (*computeFunc)(void *), void *args) {
+    return insertTasks(tp, NULL, computeFunc, &args, 1, TP_WAIT_FOREVER, NULL);
+}
+
+
+// the function gets thread pool, func and args
+// it inserts the task if the queue has room, returns -1 if it hasn't
+int tpTryInsertTask(ThreadPool *tp, void (*computeFunc)(void *), void *args) {
+    return insertTasks(tp, NULL, computeFunc, &args, 1, 0, NULL);
+}
+
+
+// the function gets thread pool, func, args and timeout in milliseconds
+// it inserts the task once the queue has room, returns -1 if it got none in time
+int tpInsertTaskTimeout(ThreadPool *tp, void (*computeFunc)(void *), void *args, long timeoutMs) {
+    if (timeoutMs < 0) {
+        return -1;
+    }
+
+    return insertTasks(tp, NULL, computeFunc, &args, 1, timeoutMs, NULL);
+}
+
+
+// the function returns a new token nobody cancelled yet
+TPToken *tpCreateToken(void) {
+    TPToken *token = (TPToken *) malloc(sizeof(TPToken));
+    if (token == NULL) {
+        return NULL;
+    }
+
+    token->isCancelled = 0;
+    token->refs = 1;
+
+    return token;
+}
+
+
+// the function gets token
+// it marks the token cancelled, workers drop its tasks as they take them
+void tpCancelToken(TPToken *token) {
+    __atomic_store_n(&token->isCancelled, 1, __ATOMIC_RELEASE);
+}
+
+
+// the function gets token
+// it returns 1 if the token was cancelled
+int tpIsTokenCancelled(TPToken *token) {
+    return __atomic_load_n(&token->isCancelled, __ATOMIC_ACQUIRE);
+}
+
+
+// the function gets token
+// it drops one reference and frees the token with the last one
+void tpReleaseToken(TPToken *token) {
+    if (__atomic_sub_fetch(&token->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(token);
+    }
+}
+
+
+// the function gets thread pool, func, args, their size and timeout in milliseconds
+// it inserts a task with a copy of the args, in the task itself or on the heap if they don't fit
+static int insertCopy(ThreadPool *tp, void (*computeFunc)(void *), const void *argBytes, size_t argSize,
+                      long timeoutMs) {
+    if (argBytes == NULL && argSize > 0) {
+        return -1;
+    }
+
+    Task proto;
+    proto.token = NULL;
+    proto.deadlineNs = 0;
+    proto.group = NULL;
+    proto.argSize = argSize;
+
+    // args too big for the task are copied to the heap before taking room in the queue
+    void *args = (void *) argBytes;
+    if (argSize > TP_TASK_INLINE) {
+        args = malloc(argSize);
+        if (args == NULL) {
+            return -1;
+        }
+        memcpy(args, argBytes, argSize);
+    }
+
+    if (insertTasks(tp, NULL, computeFunc, &args, 1, timeoutMs, &proto) != 0) {
+        if (argSize > TP_TASK_INLINE) {
+            free(args);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// the function gets thread pool, func, args and their size
+// it inserts a task with a copy of the args
+int tpInsertTaskCopy(ThreadPool *tp, void (*computeFunc)(void *), const void *argBytes, size_t argSize) {
+    return insertCopy(tp, computeFunc, argBytes, argSize, TP_WAIT_FOREVER);
+}
+
+
+// the function gets thread pool, func, args, their size and timeout in milliseconds
+// it inserts a task with a copy of the args once the queue has room, returns -1 if it got none in time
+int tpInsertTaskCopyTimeout(ThreadPool *tp, void (*computeFunc)(void *), const void *argBytes, size_t argSize,
+                            long timeoutMs) {
+    if (timeoutMs < 0) {
+        return -1;
+    }
+
+    return insertCopy(tp, computeFunc, argBytes, argSize, timeoutMs);
+}
+
+
+// the function gets thread pool, token, deadline in microseconds, func and args
+// it inserts the task, a worker taking it after the token is cancelled or the deadline passed drops it
+int tpInsertTaskCancellable(ThreadPool *tp, TPToken *token, long deadlineUs, void (*computeFunc)(void *),
+                            void *args) {
+    if (deadlineUs < 0) {
+        return -1;
+    }
+
+    Task proto;
+    proto.token = token;
+    proto.deadlineNs = (deadlineUs > 0) ? nowNs() + deadlineUs * 1000LL : 0;
+    proto.group = NULL;
+    proto.argSize = 0;
+
+    // the task holds the token until it runs or is dropped
+    if (token != NULL) {
+        __atomic_add_fetch(&token->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    if (insertTasks(tp, NULL, computeFunc, &args, 1, TP_WAIT_FOREVER, &proto) != 0) {
+        if (token != NULL) {
+            tpReleaseToken(token);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// the function gets strand, called under its bucket's mutex
+// it takes the empty strand off its bucket and keeps it for the next key
+static void recycleStrand(Strand *strand) {
+    StrandBucket *bucket = strand->bucket;
+    Strand **link = &(bucket->strands);
+
+    while (*link != strand) {
+        link = &((*link)->next);
+    }
+    *link = strand->next;
+
+    strand->next = bucket->free;
+    bucket->free = strand;
+}
+
+
+// the function gets thread pool and strand, the caller is inside a submit
+// it queues the strand's runner behind the tasks already waiting, so a strand doesn't hold its worker
+// the runner rides on the slot of a task of its strand, so it's let in even if the queue is full
+static void queueStrand(ThreadPool *tp, Strand *strand) {
+    Task *task = allocTask(tp);
+    task->args = strand;
+    task->func = runStrand;
+    task->enqueueNs = nowNs();
+    task->token = NULL;
+    task->deadlineNs = 0;
+    task->group = NULL;
+    task->argSize = 0;
+    task->node.next = NULL;
+
+    // taking the runner gives back a slot like any task
+    if (tp->config.queueCapacity != 0) {
+        __atomic_add_fetch(&tp->occupied, 1, __ATOMIC_SEQ_CST);
+    }
+
+    __atomic_add_fetch(&tp->inFlight, 1, __ATOMIC_SEQ_CST);
+    enqueueShared(tp, task, task, 1);
+}
+
+
+// the function gets strand as void
+// it runs the strand's tasks in order, after a batch it queues itself again instead of holding the worker
+// the strand is recycled once it runs out of tasks
+static void runStrand(void *x) {
+    Strand *strand = (Strand *) x;
+    StrandBucket *bucket = strand->bucket;
+    ThreadPool *tp = strand->tp;
+    int n = 0;
+
+    while (1) {
+        // lock bucket mutex
+        if (pthread_mutex_lock(&(bucket->mutex)) != 0) {
+            sys_error();
+        }
+
+        if (osIsQueueEmpty(&(strand->queue))) {
+            strand->isScheduled = 0;
+            recycleStrand(strand);
+            if (pthread_mutex_unlock(&(bucket->mutex)) != 0) {
+                sys_error();
+            }
+            return;
+        }
+
+        Task *task = NULL;
+        if (n < TP_BATCH_SIZE) {
+            task = (Task *) osDequeueNode(&(strand->queue));
+        }
+
+        // unlock bucket mutex
+        if (pthread_mutex_unlock(&(bucket->mutex)) != 0) {
+            sys_error();
+        }
+
+        // a pool going down takes no tasks, the rest of the strand runs here
+        if (task == NULL) {
+            if (enterSubmit(tp) == 0) {
+                queueStrand(tp, strand);
+                leaveSubmit(tp);
+                return;
+            }
+            n = 0;
+            continue;
+        }
+
+        releaseTasks(tp, 1);
+        ((task->func))(task->args);
+        freeTask(tp, task);
+        ++n;
+    }
+}
+
+
+// the function gets bucket and key, called under the bucket's mutex
+// it returns the key's strand, a recycled or new one if the key has no tasks
+static Strand *findStrand(ThreadPool *tp, StrandBucket *bucket, unsigned long key) {
+    Strand *strand;
+
+    for (strand = bucket->strands; strand != NULL; strand = strand->next) {
+        if (strand->key == key) {
+            return strand;
+        }
+    }
+
+    strand = bucket->free;
+    if (strand != NULL) {
+        bucket->free = strand->next;
+    } else {
+        strand = (Strand *) malloc(sizeof(Strand));
+        if (strand == NULL) {
+            sys_error();
+        }
+    }
+
+    strand->key = key;
+    strand->queue.head = strand->queue.tail = NULL;
+    strand->isScheduled = 0;
+    strand->bucket = bucket;
+    strand->tp = tp;
+    strand->next = bucket->strands;
+    bucket->strands = strand;
+
+    return strand;
+}
+
+
+// the function gets thread pool, key, func and args
+// it queues the task on the key's strand and schedules the strand if it isn't already
+int tpInsertTaskKeyed(ThreadPool *tp, unsigned long key, void (*computeFunc)(void *), void *args) {
+    // case thread pool isn't running
+    if (enterSubmit(tp) != 0) {
+        return -1;
+    }
+
+    // case queue is full, keyed tasks count against it until their strand takes them
+    if (admitTasks(tp, 1, TP_WAIT_FOREVER) != 0) {
+        leaveSubmit(tp);
+        return -1;
+    }
+
+    // take a task from the slab
+    Task *task = allocTask(tp);
+    task->args = args;
+    task->func = computeFunc;
+    task->enqueueNs = nowNs();
+    task->token = NULL;
+    task->deadlineNs = 0;
+    task->group = NULL;
+    task->argSize = 0;
+
+    // fibonacci hashing spreads keys that differ only in their high bits too
+    unsigned long long hash = (unsigned long long) key * 0x9E3779B97F4A7C15ull;
+    StrandBucket *bucket = &(tp->strandBuckets[(hash >> 32) & (tp->strandBucketCount - 1)]);
+
+    // lock bucket mutex
+    if (pthread_mutex_lock(&(bucket->mutex)) != 0) {
+        sys_error();
+    }
+
+    Strand *strand = findStrand(tp, bucket, key);
+    osEnqueueNode(&(strand->queue), &(task->node));
+    int isIdle = !strand->isScheduled;
+    strand->isScheduled = 1;
+
+    // unlock bucket mutex
+    if (pthread_mutex_unlock(&(bucket->mutex)) != 0) {
+        sys_error();
+    }
+
+    // still inside the submit, so the pool takes the runner
+    if (isIdle) {
+        queueStrand(tp, strand);
+    }
+    leaveSubmit(tp);
+
+    return 0;
+}
+
+
+// the function gets thread pool, priority, func and args
+// it inserts the task to its level's queue, normal tasks take the usual path
+int tpInsertTaskPriority(ThreadPool *tp, priority prio, void (*computeFunc)(void *), void *args) {
+    if (prio == TP_PRIORITY_NORMAL) {
+        return tpInsertTask(tp, computeFunc, args);
+    }
+
+    // case thread pool isn't running or no such level
+    if (prio < TP_PRIORITY_CRITICAL || prio >= TP_PRIORITY_LEVELS || enterSubmit(tp) != 0) {
+        return -1;
+    }
+
+    // case queue is full
+    if (admitTasks(tp, 1, TP_WAIT_FOREVER) != 0) {
+        leaveSubmit(tp);
+        return -1;
+    }
+
+    // take a task from the slab
+    Task *task = allocTask(tp);
+
+    // set task's func and args
+    task->args = args;
+    task->func = computeFunc;
+    task->enqueueNs = nowNs();
+    task->token = NULL;
+    task->deadlineNs = 0;
+    task->group = NULL;
+    task->argSize = 0;
+
+    // count the task before any worker can finish it
+    __atomic_add_fetch(&tp->inFlight, 1, __ATOMIC_SEQ_CST);
+
+    // lock level mutex
+    if (pthread_mutex_lock(&(tp->levelMutex)) != 0) {
+        sys_error();
+    }
+
+    // normal tasks start aging from when the levels are in use
+    if (tp->levelMask == 0) {
+        __atomic_store_n(&tp->lastNormalNs, task->enqueueNs, __ATOMIC_RELAXED);
+    }
+
+    osEnqueueNode(tp->levels[prio], &(task->node));
+    tp->levelTasks++;
+    __atomic_store_n(&tp->levelMask, tp->levelMask | (1u << prio), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&tp->pending, 1, __ATOMIC_SEQ_CST);
+
+    // unlock level mutex
+    if (pthread_mutex_unlock(&(tp->levelMutex)) != 0) {
+        sys_error();
+    }
+
+    wakeForTasks(tp, 1);
+    leaveSubmit(tp);
+
+    return 0;
+}
+
+
+// the function gets thread pool, n funcs and n args
+// it inserts the n tasks under a single lock
+int tpInsertTasks(ThreadPool *tp, void (**computeFuncs)(void *), void **args, int n) {
+    return insertTasks(tp, computeFuncs, NULL, args, n, TP_WAIT_FOREVER, NULL);
+}
+
+
+// the function gets thread pool, func and n args
+// it inserts n tasks of the same func under a single lock
+int tpInsertTaskBatch(ThreadPool *tp, void (*computeFunc)(void *), void **args, int n) {
+    return insertTasks(tp, NULL, computeFunc, args, n, TP_WAIT_FOREVER, NULL);
+}
+
+
+// the function gets thread pool
+// it returns the tick the timer wheel should be at now
+static unsigned long long timerNow(ThreadPool *tp) {
+    return (unsigned long long) ((nowNs() - tp->timerStartNs) / (tp->config.timerTickUs * 1000LL));
+}
+
+
+// the function gets thread pool and index of a timer
+// it returns the timer's entry
+static TimerEntry *timerEntry(ThreadPool *tp, unsigned int index) {
+    return &(tp->timerChunks[index / TP_TIMER_CHUNK][index % TP_TIMER_CHUNK]);
+}
+
+
+// the function gets thread pool, called under timer mutex
+// it returns the index of a free timer entry, adding a chunk of them if none is left
+static unsigned int allocTimer(ThreadPool *tp) {
+    if (tp->timerFree == TP_TIMER_NONE) {
+        TimerEntry **chunks = (TimerEntry **) realloc(tp->timerChunks,
+                                                      sizeof(TimerEntry *) * (tp->timerChunkCount + 1));
+        if (chunks == NULL) {
+            sys_error();
+        }
+        tp->timerChunks = chunks;
+
+        TimerEntry *chunk = (TimerEntry *) malloc(sizeof(TimerEntry) * TP_TIMER_CHUNK);
+        if (chunk == NULL) {
+            sys_error();
+        }
+
+        unsigned int base = tp->timerChunkCount * TP_TIMER_CHUNK;
+        unsigned int i;
+        for (i = 0; i < TP_TIMER_CHUNK; ++i) {
+            chunk[i].timer.next = chunk[i].timer.prev = NULL;
+            chunk[i].index = base + i;
+            chunk[i].generation = 0;
+            chunk[i].nextFree = (i + 1 < TP_TIMER_CHUNK) ? base + i + 1 : TP_TIMER_NONE;
+        }
+        tp->timerChunks[tp->timerChunkCount++] = chunk;
+        tp->timerFree = base;
+    }
+
+    unsigned int index = tp->timerFree;
+    tp->timerFree = timerEntry(tp, index)->nextFree;
+
+    return index;
+}
+
+
+// the function gets thread pool and index of a timer that left the wheel, called under timer mutex
+// it gives the entry back, ids of its old timer don't match it anymore
+static void freeTimer(ThreadPool *tp, unsigned int index) {
+    TimerEntry *entry = timerEntry(tp, index);
+
+    entry->generation++;
+    entry->nextFree = tp->timerFree;
+    tp->timerFree = index;
+}
+
+
+// the function gets thread pool and time since the timer wheel started
+// it returns the first tick at or after the time, the timer thread sees it once the clock passes it
+static unsigned long long dueTick(ThreadPool *tp, long long dueNs) {
+    long long tickNs = tp->config.timerTickUs * 1000LL;
+
+    return (unsigned long long) ((dueNs + tickNs - 1) / tickNs);
+}
+
+
+// the function gets timer entry of a periodic task
+// it runs the task, then runs it again at once if a deadline passed meanwhile and overruns coalesce
+static void runPeriodic(void *x) {
+    TimerEntry *entry = (TimerEntry *) x;
+    ThreadPool *tp = entry->tp;
+    int isAgain;
+
+    ((entry->func))(entry->args);
+
+    // lock timer mutex
+    if (pthread_mutex_lock(&(tp->timerMutex)) != 0) {
+        sys_error();
+    }
+
+    isAgain = entry->isOverrun && !entry->isCancelled;
+    entry->isOverrun = 0;
+
+    // queue the extra run under the mutex so cancel still sees it running, a full queue skips it
+    if (!isAgain || insertTasks(tp, NULL, runPeriodic, &x, 1, 0, NULL) != 0) {
+        entry->isRunning = 0;
+        if (entry->isCancelled) {
+            freeTimer(tp, entry->index);
+        }
+    }
+
+    // unlock timer mutex
+    if (pthread_mutex_unlock(&(tp->timerMutex)) != 0) {
+        sys_error();
+    }
+}
+
+
+// the function gets thread pool
+// the timer thread moves due tasks to the run queue and sleeps until the wheel's next tick
+static void *timerLoop(void *x) {
+    ThreadPool *tp = (ThreadPool *) x;
+    void (*funcs[TP_BATCH_SIZE])(void *);
+    void *args[TP_BATCH_SIZE];
+
+    // lock timer mutex
+    if (pthread_mutex_lock(&(tp->timerMutex)) != 0) {
+        sys_error();
+    }
+
+    while (!tp->isTimerStopping) {
+        OSTimer *expired = osWheelAdvance(tp->wheel, timerNow(tp));
+
+        // insert the due tasks a batch at a time, cancel may take the mutex in between
+        while (expired != NULL) {
+            int n = 0;
+            while (expired != NULL && n < TP_BATCH_SIZE) {
+                TimerEntry *entry = (TimerEntry *) expired;
+                expired = expired->next;
+
+                if (entry->periodNs == 0) {
+                    funcs[n] = entry->func;
+                    args[n] = entry->args;
+                    freeTimer(tp, entry->index);
+                    ++n;
+                    continue;
+                }
+
+                // periodic task is due again, deadlines already past are missed
+                long long now = nowNs() - tp->timerStartNs;
+                entry->dueNs += entry->periodNs;
+                if (entry->dueNs <= now) {
+                    entry->dueNs += ((now - entry->dueNs) / entry->periodNs + 1) * entry->periodNs;
+                }
+                osWheelAdd(tp->wheel, &(entry->timer), dueTick(tp, entry->dueNs));
+
+                if (entry->isRunning) {
+                    entry->isOverrun = (tp->config.periodicOverrun == TP_OVERRUN_COALESCE);
+                    continue;
+                }
+                entry->isRunning = 1;
+                funcs[n] = runPeriodic;
+                args[n] = entry;
+                ++n;
+            }
+
+            if (pthread_mutex_unlock(&(tp->timerMutex)) != 0) {
+                sys_error();
+            }
+            insertTasks(tp, funcs, NULL, args, n, TP_WAIT_FOREVER, NULL);
+            if (pthread_mutex_lock(&(tp->timerMutex)) != 0) {
+                sys_error();
+            }
+        }
+
+        // sleep until the next tick with timers or until an earlier timer is added
+        long long next = osWheelNextTick(tp->wheel);
+        tp->timerWakeTick = next;
+        if (next < 0) {
+            if (pthread_cond_wait(&(tp->timerCond), &(tp->timerMutex)) != 0) {
+                sys_error();
+            }
+            continue;
+        }
+
+        long long wakeNs = tp->timerStartNs + next * tp->config.timerTickUs * 1000LL;
+        struct timespec deadline;
+        deadline.tv_sec = (time_t) (wakeNs / 1000000000LL);
+        deadline.tv_nsec = (long) (wakeNs % 1000000000LL);
+        int result = pthread_cond_timedwait(&(tp->timerCond), &(tp->timerMutex), &deadline);
+        if (result != 0 && result != ETIMEDOUT) {
+            sys_error();
+        }
+    }
+
+    // unlock timer mutex
+    if (pthread_mutex_unlock(&(tp->timerMutex)) != 0) {
+        sys_error();
+    }
+
+    return NULL;
+}
+
+
+// the function gets thread pool, delay and period in microseconds, func and args
+// it puts the task in the timer wheel, the timer thread inserts it once it's due
+static TPTimerId scheduleTimer(ThreadPool *tp, long delayUs, long periodUs, void (*computeFunc)(void *),
+                               void *args) {
+    // case thread pool isn't running
+    if (delayUs < 0 || periodUs < 0 || enterSubmit(tp) != 0) {
+        return 0;
+    }
+
+    // lock timer mutex
+    if (pthread_mutex_lock(&(tp->timerMutex)) != 0) {
+        sys_error();
+    }
+
+    // tpDestroy stopped the timer thread already
+    if (tp->isTimerStopping) {
+        if (pthread_mutex_unlock(&(tp->timerMutex)) != 0) {
+            sys_error();
+        }
+        leaveSubmit(tp);
+        return 0;
+    }
+
+    // first timer, start the timer thread
+    if (!tp->hasTimerThread) {
+        if (pthread_create(&(tp->timerThread), NULL, timerLoop, (void *) tp) != 0) {
+            sys_error();
+        }
+        tp->hasTimerThread = 1;
+    }
+
+    unsigned int index = allocTimer(tp);
+    TimerEntry *entry = timerEntry(tp, index);
+    entry->tp = tp;
+    entry->func = computeFunc;
+    entry->args = args;
+    entry->periodNs = periodUs * 1000LL;
+    entry->dueNs = nowNs() - tp->timerStartNs + delayUs * 1000LL;
+    entry->isRunning = 0;
+    entry->isCancelled = 0;
+    entry->isOverrun = 0;
+
+    unsigned long long expires = dueTick(tp, entry->dueNs);
+    osWheelAdd(tp->wheel, &(entry->timer), expires);
+
+    // the timer thread sleeps past this timer
+    if (tp->timerWakeTick < 0 || (long long) expires < tp->timerWakeTick) {
+        if (pthread_cond_signal(&(tp->timerCond)) != 0) {
+            sys_error();
+        }
+    }
+
+    TPTimerId id = ((TPTimerId) (index + 1) << 32) | entry->generation;
+
+    // unlock timer mutex
+    if (pthread_mutex_unlock(&(tp->timerMutex)) != 0) {
+        sys_error();
+    }
+    leaveSubmit(tp);
+
+    return id;
+}
+
+
+// the function gets thread pool, delay in microseconds, func and args
+// it inserts the task once the delay passed
+TPTimerId tpScheduleAfter(ThreadPool *tp, long delayUs, void (*computeFunc)(void *), void *args) {
+    return scheduleTimer(tp, delayUs, 0, computeFunc, args);
+}
+
+
+// the function gets thread pool, period in microseconds, func and args
+// it inserts the task at every multiple of the period from now, so late runs don't push the next ones
+TPTimerId tpScheduleEvery(ThreadPool *tp, long periodUs, void (*computeFunc)(void *), void *args) {
+    if (periodUs < 1) {
+        return 0;
+    }
+
+    return scheduleTimer(tp, periodUs, periodUs, computeFunc, args);
+}
+
+
+// the function gets thread pool and id of a scheduled task
+// it takes the task out of the timer wheel if it isn't due yet, a periodic task stops recurring
+int tpCancelTimer(ThreadPool *tp, TPTimerId id) {
+    int result = -1;
+
+    if (id == 0) {
+        return -1;
+    }
+
+    // lock timer mutex
+    if (pthread_mutex_lock(&(tp->timerMutex)) != 0) {
+        sys_error();
+    }
+
+    unsigned long long index = (id >> 32) - 1;
+    if (index < (unsigned long long) tp->timerChunkCount * TP_TIMER_CHUNK) {
+        TimerEntry *entry = timerEntry(tp, (unsigned int) index);
+
+        // an entry is in the wheel while it's linked there, a running periodic task frees its own
+        if (entry->generation == (unsigned int) id && entry->timer.prev != NULL) {
+            osWheelRemove(tp->wheel, &(entry->timer));
+            if (entry->isRunning) {
+                entry->isCancelled = 1;
+            } else {
+                freeTimer(tp, (unsigned int) index);
+            }
+            result = 0;
+        }
+    }
+
+    // unlock timer mutex
+    if (pthread_mutex_unlock(&(tp->timerMutex)) != 0) {
+        sys_error();
+    }
+
+    return result;
+}
+
+
+// the function gets thread pool as void
+// the reactor thread waits for ready fds and inserts their tasks
+static void *reactorLoop(void *x) {
+    ThreadPool *tp = (ThreadPool *) x;
+    struct epoll_event events[TP_BATCH_SIZE];
+    void (*funcs[TP_BATCH_SIZE])(void *);
+    void *args[TP_BATCH_SIZE];
+
+    while (1) {
+        int ready = epoll_wait(tp->epollFd, events, TP_BATCH_SIZE, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            sys_error();
+        }
+
+        // lock reactor mutex
+        if (pthread_mutex_lock(&(tp->reactorMutex)) != 0) {
+            sys_error();
+        }
+
+        if (tp->isReactorStopping) {
+            if (pthread_mutex_unlock(&(tp->reactorMutex)) != 0) {
+                sys_error();
+            }
+            return NULL;
+        }
+
+        // a watch fires once, epoll disarmed the fd until it's watched again
+        int n = 0;
+        int i;
+        for (i = 0; i < ready; ++i) {
+            int fd = (int) (events[i].data.u64 & 0xFFFFFFFFull);
+            unsigned int generation = (unsigned int) (events[i].data.u64 >> 32);
+            if (fd == tp->reactorStopFd || fd >= tp->watchCapacity || !tp->watches[fd].isWatched
+                || tp->watches[fd].generation != generation) {
+                continue;
+            }
+
+            tp->watches[fd].isWatched = 0;
+            funcs[n] = tp->watches[fd].func;
+            args[n] = tp->watches[fd].args;
+            ++n;
+        }
+
+        // unlock reactor mutex
+        if (pthread_mutex_unlock(&(tp->reactorMutex)) != 0) {
+            sys_error();
+        }
+
+        // a pool going down takes no tasks, the fired watches run here
+        if (insertTasks(tp, funcs, NULL, args, n, TP_WAIT_FOREVER, NULL) != 0) {
+            for (i = 0; i < n; ++i) {
+                ((funcs[i]))(args[i]);
+            }
+        }
+    }
+}
+
+
+// the function gets thread pool
+// it creates the epoll instance and the fd that stops it, then starts the reactor thread
+static int startReactor(ThreadPool *tp) {
+    tp->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (tp->epollFd < 0) {
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    tp->reactorStopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (tp->reactorStopFd >= 0) {
+        event.data.u64 = (unsigned long long) tp->reactorStopFd;
+    }
+    if (tp->reactorStopFd < 0 || epoll_ctl(tp->epollFd, EPOLL_CTL_ADD, tp->reactorStopFd, &event) != 0) {
+        if (tp->reactorStopFd >= 0) {
+            close(tp->reactorStopFd);
+        }
+        close(tp->epollFd);
+        tp->epollFd = tp->reactorStopFd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&(tp->reactorThread), NULL, reactorLoop, (void *) tp) != 0) {
+        sys_error();
+    }
+    tp->hasReactor = 1;
+
+    return 0;
+}
+
+
+// the function gets thread pool, fd, epoll events, func and args, called under reactor mutex
+// it makes room for the fd in the table and adds it to the reactor's epoll, or re-arms it there
+static int addWatch(ThreadPool *tp, int fd, unsigned int events, void (*computeFunc)(void *), void *args) {
+    // the table grows to the highest fd watched
+    if (fd >= tp->watchCapacity) {
+        int capacity = (tp->watchCapacity > 0) ? tp->watchCapacity : 64;
+        while (capacity <= fd) {
+            capacity *= 2;
+        }
+        FdWatch *watches = (FdWatch *) realloc(tp->watches, sizeof(FdWatch) * (size_t) capacity);
+        if (watches == NULL) {
+            return -1;
+        }
+        memset(watches + tp->watchCapacity, 0, sizeof(FdWatch) * (size_t) (capacity - tp->watchCapacity));
+        tp->watches = watches;
+        tp->watchCapacity = capacity;
+    }
+
+    FdWatch *watch = &(tp->watches[fd]);
+    if (watch->isWatched) {
+        return -1;
+    }
+
+    watch->func = computeFunc;
+    watch->args = args;
+    watch->generation++;
+
+    struct epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.u64 = ((unsigned long long) watch->generation << 32) | (unsigned int) fd;
+
+    // re-arm a fd that stayed on epoll, a fd closed since its last watch left it and is added again
+    if (watch->isRegistered && epoll_ctl(tp->epollFd, EPOLL_CTL_MOD, fd, &event) != 0) {
+        if (errno != ENOENT) {
+            return -1;
+        }
+        watch->isRegistered = 0;
+    }
+    if (!watch->isRegistered) {
+        if (epoll_ctl(tp->epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            return -1;
+        }
+        watch->isRegistered = 1;
+    }
+    watch->isWatched = 1;
+
+    return 0;
+}
+
+
+// the function gets thread pool, fd, epoll events, func and args
+// it watches the fd, the task is inserted the first time one of the events happens
+int tpWatchFd(ThreadPool *tp, int fd, unsigned int events, void (*computeFunc)(void *), void *args) {
+    // case thread pool isn't running
+    if (fd < 0 || computeFunc == NULL || enterSubmit(tp) != 0) {
+        return -1;
+    }
+
+    // lock reactor mutex
+    if (pthread_mutex_lock(&(tp->reactorMutex)) != 0) {
+        sys_error();
+    }
+
+    // first watch starts the reactor, none after tpDestroy stopped it
+    int result = -1;
+    if (!tp->isReactorStopping && (tp->hasReactor || startReactor(tp) == 0)) {
+        result = addWatch(tp, fd, events, computeFunc, args);
+    }
+
+    // unlock reactor mutex
+    if (pthread_mutex_unlock(&(tp->reactorMutex)) != 0) {
+        sys_error();
+    }
+    leaveSubmit(tp);
+
+    return result;
+}
+
+
+// the function gets thread pool and fd
+// it takes the fd off the reactor's epoll if its task wasn't inserted yet
+int tpUnwatchFd(ThreadPool *tp, int fd) {
+    int result = -1;
+
+    // lock reactor mutex
+    if (pthread_mutex_lock(&(tp->reactorMutex)) != 0) {
+        sys_error();
+    }
+
+    if (fd >= 0 && fd < tp->watchCapacity && tp->watches[fd].isWatched) {
+        epoll_ctl(tp->epollFd, EPOLL_CTL_DEL, fd, NULL);
+        tp->watches[fd].isRegistered = 0;
+        tp->watches[fd].isWatched = 0;
+        result = 0;
+    }
+
+    // unlock reactor mutex
+    if (pthread_mutex_unlock(&(tp->reactorMutex)) != 0) {
+        sys_error();
+    }
+
+    return result;
+}
+
+
+// the function gets thread pool
+// it runs one pending task on the calling thread, returns 0 if there was none
+static int helpOnce(ThreadPool *tp) {
+    Worker *worker = currentWorker;
+    Task *task;
+
+    if (worker != NULL && worker->tp == tp) {
+        task = findTask(worker);
+    } else {
+        task = takeTask(tp, NULL);
+    }
+
+    if (task == NULL) {
+        return 0;
+    }
+
+    runTask(tp, task);
+    return 1;
+}
+
+
+// the function gets thread pool, futex word counting what's left and whether to help
+// it runs the pool's tasks while it waits for the word to reach 0, sleeps on the word when there are none
+static void helpUntilDone(ThreadPool *tp, int *word, int isHelping) {
+    int left;
+
+    while ((left = __atomic_load_n(word, __ATOMIC_SEQ_CST)) != 0) {
+        if (!isHelping || !helpOnce(tp)) {
+            futexWait(word, left, NULL);
+        }
+    }
+}
+
+
+// the function gets thread pool
+// it returns 1 if the calling thread is one of tp's workers
+static int isWorkerOf(ThreadPool *tp) {
+    return (currentWorker != NULL && currentWorker->tp == tp);
+}
+
+
+// the function gets group and thread pool
+// it starts the group with no tasks
+void tpGroupInit(TPGroup *group, ThreadPool *tp) {
+    group->tp = tp;
+    group->pending = 0;
+}
+
+
+// the function gets group, func and args
+// it inserts the task, the group counts it until it's done
+int tpGroupInsert(TPGroup *group, void (*computeFunc)(void *), void *args) {
+    Task proto;
+    proto.token = NULL;
+    proto.deadlineNs = 0;
+    proto.group = group;
+    proto.argSize = 0;
 
-#include "threadPool.h"
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_SEQ_CST);
 
+    if (insertTasks(group->tp, NULL, computeFunc, &args, 1, TP_WAIT_FOREVER, &proto) != 0) {
+        finishGroup(group);
+        return -1;
+    }
 
-// the function displays error message and exits
-void sys_error() {
-    write(2, "Error in system call\n", strlen("Error in system call\n"));
-    exit(-1);
+    return 0;
 }
 
 
-// the function gets thread pool as void
-// it does the tasks while tp running or waiting to tasks in queue
-static void *exec(void *x) {
-    // try to convert to thread pool
-    ThreadPool *tp = (ThreadPool *) x;
-    if (tp == NULL) {
-        sys_error();
+// the function gets group
+// it waits for the group's tasks, a worker runs the pool's other tasks meanwhile instead of blocking on them
+int tpGroupWait(TPGroup *group) {
+    helpUntilDone(group->tp, &group->pending, isWorkerOf(group->tp));
+
+    return 0;
+}
+
+
+// a piece of a tpParallelFor range, the loop keeps all of them in one array
+typedef struct {
+    struct parallel_for *loop;
+    long begin;
+    long end;
+} ForRange;
+
+typedef struct parallel_for {
+    ThreadPool *tp;
+    void (*body)(long, long, void *);
+    void *ctx;
+    long grain;
+    ForRange *ranges;
+    int nextRange;
+    // futex word, ranges not yet done
+    int remaining;
+    // a range was dropped by a pool going down without waiting for tasks
+    int isDropped;
+} ParallelFor;
+
+
+// the function gets loop
+// it counts one of its ranges as done and wakes the caller after the last one
+static void finishRange(ParallelFor *loop) {
+    if (__atomic_sub_fetch(&loop->remaining, 1, __ATOMIC_SEQ_CST) == 0) {
+        futexWakeAll(&loop->remaining);
     }
+}
 
-    // loop's conditions
-    int isRunning = (tp->state == ONLINE);
-    int isOffline = (tp->state == OFFLINE);
-    int isQueueNotEmpty = !(osIsQueueEmpty(tp->queue));
 
-    // while tp running or tp waits to all and queue isn't empty
-    while (isRunning || (isOffline && isQueueNotEmpty)) {
-        // lock thread pool's mutex
-        if (pthread_mutex_lock(&(tp->mutex)) != 0) {
-            sys_error();
+// the function gets range as void
+// it splits off the upper halves as tasks until the range fits the grain, then runs it
+static void runRange(void *x) {
+    ForRange *range = (ForRange *) x;
+    ParallelFor *loop = range->loop;
+    long begin = range->begin;
+    long end = range->end;
+
+    while (end - begin > loop->grain) {
+        long middle = begin + (end - begin) / 2;
+
+        ForRange *upper = &(loop->ranges[__atomic_fetch_add(&loop->nextRange, 1, __ATOMIC_RELAXED)]);
+        upper->loop = loop;
+        upper->begin = middle;
+        upper->end = end;
+        __atomic_add_fetch(&loop->remaining, 1, __ATOMIC_SEQ_CST);
+
+        // queue is full or pool is going down, do the upper half here
+        if (tpTryInsertTask(loop->tp, runRange, upper) != 0) {
+            runRange(upper);
         }
+        end = middle;
+    }
 
-        // block on condition
-        while (tp->state == ONLINE && osIsQueueEmpty(tp->queue)) {
-            if (pthread_cond_wait(&(tp->condition), &(tp->mutex)) != 0) {
-                sys_error();
-            }
+    loop->body(begin, end, loop->ctx);
+    finishRange(loop);
+}
+
+
+// the function gets thread pool, range, grain, body and ctx
+// it runs body over [begin, end) in pieces of at most grain, the caller works too
+int tpParallelFor(ThreadPool *tp, long begin, long end, long grain,
+                  void (*body)(long, long, void *), void *ctx) {
+    if (grain < 1 || begin > end) {
+        return -1;
+    }
+    if (begin == end) {
+        return 0;
+    }
+
+    // every piece but the first one is split off a bigger piece, so none is under half a grain
+    long minPiece = (grain + 1) / 2;
+    long pieces = (end - begin) / minPiece + 1;
+    ParallelFor loop;
+    loop.tp = tp;
+    loop.body = body;
+    loop.ctx = ctx;
+    loop.grain = grain;
+    loop.ranges = (ForRange *) malloc(sizeof(ForRange) * (size_t) pieces);
+    if (loop.ranges == NULL) {
+        sys_error();
+    }
+    loop.nextRange = 1;
+    loop.remaining = 1;
+    loop.isDropped = 0;
+
+    loop.ranges[0].loop = &loop;
+    loop.ranges[0].begin = begin;
+    loop.ranges[0].end = end;
+    runRange(&(loop.ranges[0]));
+
+    // help with the pool's tasks until every piece is done
+    helpUntilDone(tp, &loop.remaining, 1);
+
+    free(loop.ranges);
+    return __atomic_load_n(&loop.isDropped, __ATOMIC_SEQ_CST) ? -1 : 0;
+}
+
+
+// the function gets thread pool
+// it blocks until every inserted task is done, without stopping the workers
+int tpWaitIdle(ThreadPool *tp) {
+    // a task waiting for itself would never return
+    if (isWorkerOf(tp)) {
+        return -1;
+    }
+
+    __atomic_add_fetch(&tp->idleWaiters, 1, __ATOMIC_SEQ_CST);
+
+    int inFlight;
+    while ((inFlight = __atomic_load_n(&tp->inFlight, __ATOMIC_SEQ_CST)) != 0) {
+        futexWait(&tp->inFlight, inFlight, NULL);
+    }
+
+    __atomic_sub_fetch(&tp->idleWaiters, 1, __ATOMIC_SEQ_CST);
+
+    return 0;
+}
+
+
+// the function gets handle
+// it drops one reference and gives the handle back to the slab with the last one
+static void unrefHandle(TPHandle *handle) {
+    if (__atomic_sub_fetch(&handle->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        osSlabFree(handle->tp->handleSlab, handle);
+    }
+}
+
+
+// the function gets handle as void
+// it runs the handle's func, keeps the result and wakes the waiters
+static void runHandle(void *x) {
+    TPHandle *handle = (TPHandle *) x;
+
+    handle->result = handle->func(handle->args);
+
+    if (__atomic_exchange_n(&handle->state, TP_HANDLE_DONE, __ATOMIC_ACQ_REL) == TP_HANDLE_WAITING) {
+        futexWakeAll(&handle->state);
+    }
+
+    unrefHandle(handle);
+}
+
+
+// the function gets thread pool, func and args
+// it inserts the func and args as task and returns a handle to wait on
+TPHandle *tpSubmit(ThreadPool *tp, void *(*computeFunc)(void *), void *args) {
+    // case thread pool isn't running
+    if (lifecycle(tp) != ONLINE) {
+        return NULL;
+    }
+
+    // take a handle from the slab
+    TPHandle *handle = (TPHandle *) osSlabAlloc(tp->handleSlab);
+    if (handle == NULL) {
+        sys_error();
+    }
+
+    handle->tp = tp;
+    handle->func = computeFunc;
+    handle->args = args;
+    handle->result = NULL;
+    handle->state = TP_HANDLE_PENDING;
+    handle->refs = 2;
+
+    if (tpInsertTask(tp, runHandle, handle) != 0) {
+        osSlabFree(tp->handleSlab, handle);
+        return NULL;
+    }
+
+    return handle;
+}
+
+
+// the function gets handle, optional deadline and where to put the result
+// it blocks on the handle's futex until the task is done or the deadline passes
+static int waitHandle(TPHandle *handle, const struct timespec *deadline, void **result) {
+    int state = __atomic_load_n(&handle->state, __ATOMIC_ACQUIRE);
+
+    // a worker runs other tasks instead of holding its thread, the handle's task may be one of them
+    if (deadline == NULL && isWorkerOf(handle->tp)) {
+        while (state < TP_HANDLE_DONE && helpOnce(handle->tp)) {
+            state = __atomic_load_n(&handle->state, __ATOMIC_ACQUIRE);
         }
+    }
 
-        // dequeue task from tasks' queue
-        Task *task = (Task *) osDequeue(tp->queue);
+    while (state < TP_HANDLE_DONE) {
+        // tell the task someone has to be woken
+        if (state == TP_HANDLE_PENDING
+            && !__atomic_compare_exchange_n(&handle->state, &state, TP_HANDLE_WAITING, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
 
-        // lock thread pool's mutex
-        if (pthread_mutex_unlock(&(tp->mutex)) != 0) {
-            sys_error();
+        if (futexWait(&handle->state, TP_HANDLE_WAITING, deadline) != 0) {
+            return -1;
         }
+        state = __atomic_load_n(&handle->state, __ATOMIC_ACQUIRE);
+    }
 
-        // do task
-        if (task != NULL) {
-            ((task->func))(task->args);
-            free(task);
+    if (result != NULL) {
+        *result = handle->result;
+    }
+
+    return (state == TP_HANDLE_DROPPED) ? 1 : 0;
+}
+
+
+// the function gets handle and where to put the result
+// it blocks until the task is done
+int tpWait(TPHandle *handle, void **result) {
+    return waitHandle(handle, NULL, result);
+}
+
+
+// the function gets handle and where to put the result
+// it gets the result only if the task is already done
+int tpTryWait(TPHandle *handle, void **result) {
+    int state = __atomic_load_n(&handle->state, __ATOMIC_ACQUIRE);
+    if (state < TP_HANDLE_DONE) {
+        return -1;
+    }
+
+    if (result != NULL) {
+        *result = handle->result;
+    }
+
+    return (state == TP_HANDLE_DROPPED) ? 1 : 0;
+}
+
+
+// the function gets handle, timeout in milliseconds and where to put the result
+// it blocks until the task is done or the timeout passes
+int tpWaitTimeout(TPHandle *handle, long timeoutMs, void **result) {
+    struct timespec deadline;
+    deadlineAfter(CLOCK_MONOTONIC, timeoutMs, &deadline);
+
+    return waitHandle(handle, &deadline, result);
+}
+
+
+// the function gets handle
+// it drops the caller's reference, the handle is recycled once its task is done too
+void tpReleaseHandle(TPHandle *handle) {
+    unrefHandle(handle);
+}
+
+
+// the function gets thread pool and task
+// it frees a task that won't run, its handle ends up dropped with a NULL result
+static void dropTask(ThreadPool *tp, Task *task) {
+    if (tp->config.collectStats) {
+        int isShared;
+        int slot = currentSlot(tp, &isShared);
+        statAdd(&(tp->stats[slot].counters.dropped), 1, isShared);
+    }
+
+    if (task->func == runHandle) {
+        TPHandle *handle = (TPHandle *) task->args;
+        if (__atomic_exchange_n(&handle->state, TP_HANDLE_DROPPED, __ATOMIC_ACQ_REL) == TP_HANDLE_WAITING) {
+            futexWakeAll(&handle->state);
         }
+        unrefHandle(handle);
+    } else if (task->func == runRange) {
+        // the loop waits for every range, a dropped one is done without running
+        ParallelFor *loop = ((ForRange *) task->args)->loop;
+        __atomic_store_n(&loop->isDropped, 1, __ATOMIC_SEQ_CST);
+        finishRange(loop);
+    }
 
-        // update loop condition vars
-        isRunning = (tp->state == ONLINE);
-        isOffline = (tp->state == OFFLINE);
-        isQueueNotEmpty = !(osIsQueueEmpty(tp->queue));
+    if (task->group != NULL) {
+        finishGroup(task->group);
     }
+    freeTask(tp, task);
+    finishTasks(tp, 1);
+}
 
-    pthread_exit(NULL);
+
+// the function gets counters to add to and counters to read
+// it adds every counter
+static void addCounters(TPCounters *to, TPCounters *from) {
+    to->executed += __atomic_load_n(&from->executed, __ATOMIC_RELAXED);
+    to->busyNs += __atomic_load_n(&from->busyNs, __ATOMIC_RELAXED);
+    to->idleNs += __atomic_load_n(&from->idleNs, __ATOMIC_RELAXED);
+    to->steals += __atomic_load_n(&from->steals, __ATOMIC_RELAXED);
+    to->wakeups += __atomic_load_n(&from->wakeups, __ATOMIC_RELAXED);
+    to->dropped += __atomic_load_n(&from->dropped, __ATOMIC_RELAXED);
 }
 
 
-// the function gets num of threads
-// it creates and returns a thread pull with this num of threads
-ThreadPool *tpCreate(int threadNum) {
-    // case no positive num threads
-    if (threadNum < 1) {
-        return NULL;
+// the function gets histogram to add to and histogram to read
+// it adds every bucket
+static void addHistogram(TPHistogram *to, TPHistogram *from) {
+    int i;
+    for (i = 0; i < TP_HISTOGRAM_BUCKETS; ++i) {
+        to->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
     }
+    to->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+}
 
-    // else try to create thread pool
-    ThreadPool *tp = (ThreadPool *) malloc(sizeof(ThreadPool));
-    if (tp == NULL) {
-        sys_error();
+
+// the function gets thread pool and where to put the statistics
+// it sums the statistics of all workers and the other threads that ran tasks
+int tpGetStats(ThreadPool *tp, TPStats *stats) {
+    if (tp == NULL || stats == NULL) {
+        return -1;
     }
 
-    // set thread pool's fields
-    tp->state = ONLINE;
-    tp->threadNum = threadNum;
-    tp->queue = osCreateQueue();
+    memset(stats, 0, sizeof(TPStats));
 
-    // try to init mutex
-    if (pthread_mutex_init(&(tp->mutex), NULL) != 0) {
-        free(tp);
-        sys_error();
+    int i;
+    for (i = 0; i <= tp->threadNum; ++i) {
+        addCounters(&(stats->total), &(tp->stats[i].counters));
+        addHistogram(&(stats->queueWait), &(tp->stats[i].queueWait));
+        addHistogram(&(stats->runTime), &(tp->stats[i].runTime));
     }
 
-    // try to init condition
-    if (pthread_cond_init(&(tp->condition), NULL) != 0) {
-        free(tp);
-        sys_error();
+    stats->queueDepth = __atomic_load_n(&tp->pending, __ATOMIC_SEQ_CST);
+    stats->inFlight = __atomic_load_n(&tp->inFlight, __ATOMIC_SEQ_CST);
+    stats->liveThreads = __atomic_load_n(&tp->liveThreads, __ATOMIC_SEQ_CST);
+    stats->idleThreads = __atomic_load_n(&tp->idleCount, __ATOMIC_SEQ_CST);
+
+    return 0;
+}
+
+
+// the function gets thread pool, worker id and where to put its counters
+// it reads the worker's counters
+int tpGetWorkerStats(ThreadPool *tp, int id, TPCounters *counters) {
+    if (tp == NULL || counters == NULL || id < 0 || id >= tp->threadNum) {
+        return -1;
     }
 
-    // try to alloc threads
-    int threadsSize = sizeof(pthread_t) * (size_t) threadNum;
-    tp->threads = (pthread_t *) malloc(threadsSize);
-    if (tp->threads == NULL) {
-        free(tp);
-        sys_error();
+    memset(counters, 0, sizeof(TPCounters));
+    addCounters(counters, &(tp->stats[id].counters));
+
+    return 0;
+}
+
+
+// the function gets histogram and a fraction between 0 and 1
+// it returns the upper bound of the bucket holding that fraction of the values
+long long tpHistogramPercentile(const TPHistogram *histogram, double p) {
+    if (histogram->total == 0) {
+        return 0;
+    }
+
+    unsigned long long rank = (unsigned long long) (p * (double) histogram->total);
+    if (rank >= histogram->total) {
+        rank = histogram->total - 1;
     }
 
-    // try to create threads
+    unsigned long long seen = 0;
     int i;
-    for (i = 0; i < threadNum; ++i) {
-        if (pthread_create(&(tp->threads[i]), NULL, exec, (void *) tp) != 0) {
-            tpDestroy(tp, 0);
-            sys_error();
+    for (i = 0; i < TP_HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+        if (seen > rank) {
+            break;
         }
     }
 
-    return tp;
+    if (i < 4) {
+        return i;
+    }
+
+    // bucket i holds the i % 4 quarter of the power of two i / 4 + 1
+    int power = i / 4 + 1;
+    long long low = (long long) ((4ULL + (unsigned long long) (i % 4)) << (power - 2));
+    return low + (1LL << (power - 2)) - 1;
 }
 
 
-// the function gets thread pool, func and args
-// it inserts the func and args as task to the thread pool
-int tpInsertTask(ThreadPool *tp, void (*computeFunc)(void *), void *args) {
-    // case thread pool isn't running
-    if (tp->state != ONLINE) {
+// the function gets thread pool and path
+// it writes the events of every thread's trace ring as chrome trace event json, a thread per slot
+int tpDumpTrace(ThreadPool *tp, const char *path) {
+    if (tp == NULL || tp->traces == NULL || path == NULL) {
         return -1;
     }
 
-    // try to alloc task
-    Task *task = (Task *) malloc(sizeof(Task));
-    if (task == NULL) {
-        sys_error();
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
     }
 
-    // set task's func and args
-    task->args = args;
-    task->func = computeFunc;
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
 
-    // lock thread pool's mutex
-    if (pthread_mutex_lock(&(tp->mutex)) != 0) {
-        sys_error();
-    }
+    int i;
+    for (i = 0; i <= tp->threadNum; ++i) {
+        if (i < tp->threadNum) {
+            fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                          "\"args\": {\"name\": \"worker %d\"}}", (i > 0) ? ",\n" : "", i, i);
+        } else {
+            fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                          "\"args\": {\"name\": \"other threads\"}}", i);
+        }
 
-    // insert task to queue
-    osEnqueue(tp->queue, task);
+        // the ring keeps the newest events
+        TraceRing *ring = &(tp->traces[i]);
+        unsigned long long count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        unsigned long long n = (count > ring->capacity) ? count - ring->capacity : 0;
+        for (; n < count; ++n) {
+            // a shared ring reserves places before it writes them, skip what isn't written yet
+            // or was overwritten while we read it
+            TraceEvent *event = &(ring->events[n % ring->capacity]);
+            if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != n + 1) {
+                continue;
+            }
+            int kind = __atomic_load_n(&event->kind, __ATOMIC_RELAXED);
+            long long startNs = __atomic_load_n(&event->startNs, __ATOMIC_RELAXED);
+            long long endNs = __atomic_load_n(&event->endNs, __ATOMIC_RELAXED);
+            long long enqueueNs = __atomic_load_n(&event->enqueueNs, __ATOMIC_RELAXED);
+            void (*func)(void *) = __atomic_load_n(&event->func, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&event->seq, __ATOMIC_RELAXED) != n + 1) {
+                continue;
+            }
 
-    // signal that queue isn't empty
-    if (pthread_cond_broadcast(&(tp->condition)) != 0) {
-        sys_error();
+            double ts = (double) (startNs - tp->traceStartNs) / 1000.0;
+            double dur = (double) (endNs - startNs) / 1000.0;
+
+            if (kind == TP_TRACE_IDLE) {
+                fprintf(file, ",\n{\"name\": \"idle\", \"cat\": \"idle\", \"ph\": \"X\", \"pid\": 1, "
+                              "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}", i, ts, dur);
+            } else {
+                fprintf(file, ",\n{\"name\": \"task\", \"cat\": \"task\", \"ph\": \"X\", \"pid\": 1, "
+                              "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"func\": \"0x%lx\", "
+                              "\"enqueueUs\": %.3f, \"waitUs\": %.3f}}", i, ts, dur, (unsigned long) func,
+                        (double) (enqueueNs - tp->traceStartNs) / 1000.0, (double) (startNs - enqueueNs) / 1000.0);
+            }
+        }
     }
 
-    // unlock thread pool's mutex
-    if (pthread_mutex_unlock(&(tp->mutex)) != 0) {
-        sys_error();
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0) {
+        return -1;
     }
 
     return 0;
@@ -157,51 +3212,211 @@ int tpInsertTask(ThreadPool *tp, void (*computeFunc)(void *), void *args) {
 // it updates thread pool's state according to shouldWaitForTasks and frees all
 void tpDestroy(ThreadPool *tp, int shouldWaitForTasks) {
     // case destroy called already
-    if (tp->state == OFFLINE) {
+    if (lifecycle(tp) == OFFLINE) {
         return;
     }
 
+    // stop the timer thread, tasks that aren't due yet are dropped
+    if (pthread_mutex_lock(&(tp->timerMutex)) != 0) {
+        sys_error();
+    }
+    tp->isTimerStopping = 1;
+    if (pthread_cond_signal(&(tp->timerCond)) != 0 || pthread_mutex_unlock(&(tp->timerMutex)) != 0) {
+        sys_error();
+    }
+    if (tp->hasTimerThread && pthread_join(tp->timerThread, NULL) != 0) {
+        sys_error();
+    }
+
+    // stop the reactor thread, fds that aren't ready yet are dropped
+    if (pthread_mutex_lock(&(tp->reactorMutex)) != 0) {
+        sys_error();
+    }
+    tp->isReactorStopping = 1;
+    unsigned long long stop = 1;
+    if (tp->hasReactor && write(tp->reactorStopFd, &stop, sizeof(stop)) != sizeof(stop)) {
+        sys_error();
+    }
+    if (pthread_mutex_unlock(&(tp->reactorMutex)) != 0) {
+        sys_error();
+    }
+    if (tp->hasReactor && pthread_join(tp->reactorThread, NULL) != 0) {
+        sys_error();
+    }
+
+    // update thread pool's state, submitters that come after this fail
+    __atomic_or_fetch(&tp->state, OFFLINE, __ATOMIC_SEQ_CST);
+
+    // producers waiting for room give up
+    __atomic_add_fetch(&tp->spaceSeq, 1, __ATOMIC_SEQ_CST);
+    futexWakeAll(&tp->spaceSeq);
+
+    // wait for the submitters already inside an insert, nothing is added to the queues after them
+    int word;
+    while ((word = __atomic_load_n(&tp->state, __ATOMIC_SEQ_CST)) != OFFLINE) {
+        futexWait(&tp->state, word, NULL);
+    }
+
     // lock thread pool mutex
     if (pthread_mutex_lock(&(tp->mutex)) != 0) {
         sys_error();
     }
 
-    // if should wait for tasks is 0 free all tasks
+    // if should wait for tasks is 0 free all tasks, also the ones workers already took
     if (shouldWaitForTasks == 0) {
-        while (!osIsQueueEmpty(tp->queue)) {
-            free(osDequeue(tp->queue));
+        Task *task;
+        while ((task = (Task *) osDequeueNode(tp->queue)) != NULL) {
+            dropTask(tp, task);
+            __atomic_sub_fetch(&tp->pending, 1, __ATOMIC_SEQ_CST);
+            releaseTasks(tp, 1);
+        }
+        __atomic_store_n(&tp->queued, 0, __ATOMIC_RELAXED);
+
+        int node;
+        for (node = 0; tp->rings != NULL && node < tp->nodeCount; ++node) {
+            while ((task = (Task *) osRingDequeue(tp->rings[node])) != NULL) {
+                dropTask(tp, task);
+                __atomic_sub_fetch(&tp->pending, 1, __ATOMIC_SEQ_CST);
+                releaseTasks(tp, 1);
+            }
+        }
+
+        if (pthread_mutex_lock(&(tp->levelMutex)) != 0) {
+            sys_error();
+        }
+        int level;
+        for (level = 0; level < TP_PRIORITY_LEVELS; ++level) {
+            while (tp->levels[level] != NULL && (task = (Task *) osDequeueNode(tp->levels[level])) != NULL) {
+                dropTask(tp, task);
+                __atomic_sub_fetch(&tp->pending, 1, __ATOMIC_SEQ_CST);
+                releaseTasks(tp, 1);
+            }
+        }
+        tp->levelTasks = 0;
+        __atomic_store_n(&tp->levelMask, 0, __ATOMIC_RELEASE);
+        if (pthread_mutex_unlock(&(tp->levelMutex)) != 0) {
+            sys_error();
         }
-    }
 
-    // update thread pool's state
-    tp->state = OFFLINE;
+        int i;
+        for (i = 0; i < tp->threadNum; ++i) {
+            if ((task = takeNext(&(tp->workers[i]))) != NULL) {
+                dropTask(tp, task);
+                __atomic_sub_fetch(&tp->pending, 1, __ATOMIC_SEQ_CST);
+                releaseTasks(tp, 1);
+            }
+            while (!osIsDequeEmpty(tp->workers[i].deque)) {
+                task = (Task *) osStealTop(tp->workers[i].deque);
+                if (task != NULL) {
+                    dropTask(tp, task);
+                    __atomic_sub_fetch(&tp->pending, 1, __ATOMIC_SEQ_CST);
+                    releaseTasks(tp, 1);
+                }
+            }
+        }
+    }
 
     // unlock thread pool mutex
     if (pthread_mutex_unlock(&(tp->mutex)) != 0) {
         sys_error();
     }
 
-    // unblock all threads that block on condition
-    if (pthread_cond_broadcast(&(tp->condition)) != 0) {
+    // wait for a worker being started, no other starts after this
+    if (pthread_mutex_lock(&(tp->resizeMutex)) != 0 || pthread_mutex_unlock(&(tp->resizeMutex)) != 0) {
         sys_error();
     }
 
-    // join all threads
+    // unblock all idle workers
+    wakeWorkers(tp, tp->threadNum);
+
+    // join all threads, also the ones that retired
     int i;
     for (i = 0; i < tp->threadNum; ++i) {
-        if (pthread_join(tp->threads[i], NULL) != 0) {
+        if (tp->workers[i].status != TP_WORKER_NONE && pthread_join(tp->threads[i], NULL) != 0) {
             sys_error();
         }
     }
 
+    // tasks left in strands by a pool that didn't wait for them
+    unsigned int bucket;
+    for (bucket = 0; bucket < tp->strandBucketCount; ++bucket) {
+        Strand *strand = tp->strandBuckets[bucket].strands;
+        Strand *next;
+        while (strand != NULL) {
+            next = strand->next;
+            Task *task;
+            while ((task = (Task *) osDequeueNode(&(strand->queue))) != NULL) {
+                freeTask(tp, task);
+            }
+            free(strand);
+            strand = next;
+        }
+        for (strand = tp->strandBuckets[bucket].free; strand != NULL; strand = next) {
+            next = strand->next;
+            free(strand);
+        }
+        if (pthread_mutex_destroy(&(tp->strandBuckets[bucket].mutex)) != 0) {
+            sys_error();
+        }
+    }
+    free(tp->strandBuckets);
+
     // free all
+    for (i = 0; i < tp->threadNum; ++i) {
+        osDestroyDeque(tp->workers[i].deque);
+        sem_destroy(&(tp->workers[i].wakeup));
+    }
+    free(tp->workers);
+    free(tp->stats);
+    for (i = 0; tp->traces != NULL && i <= tp->threadNum; ++i) {
+        free(tp->traces[i].events);
+    }
+    free(tp->traces);
+    free(tp->idle);
     free(tp->threads);
     osDestroyQueue(tp->queue);
+    int node;
+    for (node = 0; tp->rings != NULL && node < tp->nodeCount; ++node) {
+        osDestroyRing(tp->rings[node]);
+    }
+    free(tp->rings);
+    free(tp->cpuNode);
+    osDestroySlab(tp->taskSlab);
+    osDestroySlab(tp->handleSlab);
 
     if (pthread_mutex_destroy(&(tp->mutex)) != 0) {
         sys_error();
     }
-    if (pthread_cond_destroy(&(tp->condition)) != 0) {
+    int level;
+    for (level = 0; level < TP_PRIORITY_LEVELS; ++level) {
+        osDestroyQueue(tp->levels[level]);
+    }
+    if (pthread_mutex_destroy(&(tp->levelMutex)) != 0) {
+        sys_error();
+    }
+    if (pthread_mutex_destroy(&(tp->idleMutex)) != 0) {
+        sys_error();
+    }
+    if (pthread_mutex_destroy(&(tp->resizeMutex)) != 0) {
+        sys_error();
+    }
+
+    if (tp->hasReactor) {
+        close(tp->epollFd);
+        close(tp->reactorStopFd);
+    }
+    free(tp->watches);
+    if (pthread_mutex_destroy(&(tp->reactorMutex)) != 0) {
+        sys_error();
+    }
+
+    osDestroyWheel(tp->wheel);
+    unsigned int chunk;
+    for (chunk = 0; chunk < tp->timerChunkCount; ++chunk) {
+        free(tp->timerChunks[chunk]);
+    }
+    free(tp->timerChunks);
+    if (pthread_mutex_destroy(&(tp->timerMutex)) != 0 || pthread_cond_destroy(&(tp->timerCond)) != 0) {
         sys_error();
     }
 
@@ -5,35 +5,495 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <time.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include "osqueue.h"
+#include "osdeque.h"
+#include "osring.h"
+#include "osslab.h"
+#include "oswheel.h"
 
 
 typedef enum { ONLINE, OFFLINE } state;
 
+// normal tasks take the fast path, the other levels have a queue each
+typedef enum {
+    TP_PRIORITY_CRITICAL,
+    TP_PRIORITY_HIGH,
+    TP_PRIORITY_NORMAL,
+    TP_PRIORITY_LOW,
+    TP_PRIORITY_LEVELS
+} priority;
 
+
+// where workers run: anywhere, packed on neighbouring cpus, spread over the numa nodes,
+// on the cpus of TPConfig's list, or in one sub-pool per numa node with its own task ring
+typedef enum {
+    TP_PLACEMENT_NONE,
+    TP_PLACEMENT_COMPACT,
+    TP_PLACEMENT_SCATTER,
+    TP_PLACEMENT_LIST,
+    TP_PLACEMENT_NUMA
+} placement;
+
+
+// tasks a worker keeps for reuse before giving them back to the slab
+#define TP_TASK_CACHE 32
+
+// args tpInsertTaskCopy keeps in the task itself, with their size they fill the task's second cache line
+#define TP_TASK_INLINE 56
+
+// life of a worker slot in an elastic pool
+#define TP_WORKER_NONE 0
+#define TP_WORKER_RUNNING 1
+#define TP_WORKER_EXITED 2
+
+
+struct thread_pool;
+
+// tasks inserted with tpGroupInsert, waited for together with tpGroupWait
 typedef struct {
+    struct thread_pool *tp;
+    // futex word, tasks of the group not done yet
+    int pending;
+} TPGroup;
+
+// cancellation token shared by a group of tasks, cancelling it drops the ones that didn't start
+typedef struct {
+    int isCancelled;
+    // one reference for the caller and one for every task holding it
+    int refs;
+} TPToken;
+
+typedef struct {
+    // links the task in the queue, must stay first
+    OSNode node;
     void *args;
     void (*func)(void *);
+    long long enqueueNs;
+    // a task whose token is cancelled or whose deadline passed is dropped instead of run
+    TPToken *token;
+    long long deadlineNs;
+    // group told when the task is done or dropped, NULL if none
+    TPGroup *group;
+    // size of args copied by tpInsertTaskCopy, a copy bigger than TP_TASK_INLINE is on the heap, 0 if none
+    // it starts the second cache line, only freeing the task reads it for tasks that aren't copies
+    size_t argSize;
+    // copy of the args of tpInsertTaskCopy
+    char inlineArgs[TP_TASK_INLINE];
 } Task;
 
+// log-linear histogram of nanoseconds, four buckets per power of two
+#define TP_HISTOGRAM_BUCKETS 252
+
+typedef struct {
+    unsigned long long counts[TP_HISTOGRAM_BUCKETS];
+    unsigned long long total;
+} TPHistogram;
+
+// counters of a worker, or of all of them
+typedef struct {
+    unsigned long long executed;
+    unsigned long long busyNs;
+    unsigned long long idleNs;
+    unsigned long long steals;
+    unsigned long long wakeups;
+    // tasks dropped without running, cancelled, expired or left behind by tpDestroy
+    unsigned long long dropped;
+} TPCounters;
+
+// statistics of one worker, only the worker writes them, padded so no two share a cache line
+typedef struct {
+    TPCounters counters;
+    TPHistogram queueWait;
+    TPHistogram runTime;
+    char pad[OS_CACHE_LINE - (sizeof(TPCounters) + 2 * sizeof(TPHistogram)) % OS_CACHE_LINE];
+} WorkerStats;
+
+// snapshot of the thread pool, filled in by tpGetStats
+typedef struct {
+    TPCounters total;
+    // tasks waiting to run, and tasks inserted and not done yet
+    long queueDepth;
+    long inFlight;
+    int liveThreads;
+    int idleThreads;
+    TPHistogram queueWait;
+    TPHistogram runTime;
+} TPStats;
+
+// kinds of trace events
+#define TP_TRACE_TASK 0
+#define TP_TRACE_IDLE 1
+
+// a task that ran or a time a worker had none, idle events have no func and no enqueue time
+typedef struct {
+    long long enqueueNs;
+    long long startNs;
+    long long endNs;
+    void (*func)(void *);
+    int kind;
+    // place in the ring plus 1 once the fields are written, 0 while they're being written
+    unsigned long long seq;
+} TraceEvent;
+
+// trace events of one thread, the newest overwrite the oldest
+typedef struct {
+    TraceEvent *events;
+    unsigned long capacity;
+    unsigned long long count;
+    char pad[OS_CACHE_LINE - sizeof(TraceEvent *) - sizeof(unsigned long) - sizeof(unsigned long long)];
+} TraceRing;
+
+// id of a scheduled task, 0 is never a valid id
+typedef unsigned long long TPTimerId;
+
+// timers are kept in chunks so they never move
+#define TP_TIMER_CHUNK 1024
+
+// what a periodic task does when its time comes while its last run is still going
+typedef enum { TP_OVERRUN_SKIP, TP_OVERRUN_COALESCE } overrun;
+
+// a task waiting in the timer wheel, ids are its index and generation
+typedef struct {
+    // links the timer in the wheel, must stay first
+    OSTimer timer;
+    struct thread_pool *tp;
+    void (*func)(void *);
+    void *args;
+    unsigned int index;
+    unsigned int generation;
+    unsigned int nextFree;
+    // period and next deadline of a periodic task, 0 for a task that runs once
+    long long periodNs;
+    long long dueNs;
+    // a run is queued or running, the entry is freed by it if cancelled meanwhile
+    int isRunning;
+    int isCancelled;
+    // a deadline passed during the run, coalesced into one more run after it
+    int isOverrun;
+} TimerEntry;
+
+// states of a handle's futex word, the states from TP_HANDLE_DONE on end the wait
+#define TP_HANDLE_PENDING 0
+#define TP_HANDLE_WAITING 1
+#define TP_HANDLE_DONE 2
+#define TP_HANDLE_DROPPED 3
+
+// completion handle of a task inserted with tpSubmit
+typedef struct {
+    struct thread_pool *tp;
+    void *(*func)(void *);
+    void *args;
+    void *result;
+    // futex word, waiters sleep on it until the task is done
+    int state;
+    // one reference for the task and one for the caller
+    int refs;
+} TPHandle;
+
+// tasks of one key, they run one at a time in the order they were inserted
+// a strand lives while its key has tasks, then it goes back to its bucket's free list
+typedef struct strand {
+    unsigned long key;
+    OSQueue queue;
+    // a task running the strand's tasks is queued or running
+    int isScheduled;
+    struct strand *next;
+    struct strand_bucket *bucket;
+    struct thread_pool *tp;
+} Strand;
+
+// strands of the keys hashed to the bucket and its free strands, both guarded by its mutex
+// keys sharing a bucket share only the mutex, their tasks still run in parallel
+typedef struct strand_bucket {
+    pthread_mutex_t mutex;
+    Strand *strands;
+    Strand *free;
+    char pad[OS_CACHE_LINE - (sizeof(pthread_mutex_t) + 2 * sizeof(Strand *)) % OS_CACHE_LINE];
+} StrandBucket;
+
+// a fd the reactor waits on, its task is inserted once the fd is ready
+typedef struct {
+    void (*func)(void *);
+    void *args;
+    int isWatched;
+    // fd is on the reactor's epoll, disarmed there once its watch fired until the next watch re-arms it
+    int isRegistered;
+    // tells a stale event of an earlier watch of the same fd from this one
+    unsigned int generation;
+} FdWatch;
+
+// thread pool's options, tpConfigInit sets the defaults
 typedef struct {
+    // max num of threads, minThreads of them start with the pool
+    int threadNum;
+    int minThreads;
+    // a worker above minThreads exits after idling this long, 0 to keep it
+    long idleTimeoutMs;
+    // start another worker when this many tasks wait or a task waited growWaitMs
+    long growQueueDepth;
+    long growWaitMs;
+    // capacity of a lock-free ring used as the task queue, 0 for the locked list only
+    int ringCapacity;
+    // tasks preallocated at creation, more are taken from the heap
+    int taskSlabCapacity;
+    // an idle worker spins this many times, then yields this many times, then parks
+    long idleSpins;
+    int idleYields;
+    // spin only about as long as the time between submissions, up to idleSpins
+    int adaptiveSpin;
+    // handles preallocated at creation, more are taken from the heap
+    int handleSlabCapacity;
+    // a task waiting longer than this runs before higher levels, 0 to never age
+    long priorityAgingMs;
+    // worker i is pinned to cpus[i % cpuCount] with TP_PLACEMENT_LIST, read during creation only
+    placement placement;
+    const int *cpus;
+    int cpuCount;
+    // max num of tasks waiting to run, inserting more waits for room, 0 for no limit
+    long queueCapacity;
+    // keep counters and histograms for tpGetStats, the histograms sample one of 16 tasks
+    int collectStats;
+    // trace events kept per thread for tpDumpTrace, 0 to not trace
+    long traceEvents;
+    // resolution of scheduled tasks, delays are rounded up to it
+    long timerTickUs;
+    // skip the deadlines a periodic task misses while it runs, or run once more right after
+    overrun periodicOverrun;
+} TPConfig;
+
+typedef struct {
+    struct thread_pool *tp;
+    int id;
+    unsigned int seed;
+    OSDeque *deque;
+    // newest task inserted from the worker, it runs next, other workers take it only when the deque is empty
+    Task *next;
+    Task *freeTasks[TP_TASK_CACHE];
+    int freeCount;
+    // parked workers block on their own semaphore
+    sem_t wakeup;
+    // position in the idle registry, -1 when not parked
+    int idleIndex;
+    // measured length of one idle spin
+    long spinNs;
+    // TP_WORKER_NONE, TP_WORKER_RUNNING or TP_WORKER_EXITED, changed under resizeMutex
+    int status;
+    // pinned cpu, -1 for anywhere on the node
+    int cpu;
+    // sub-pool of the worker, always 0 unless the placement is TP_PLACEMENT_NUMA
+    int node;
+    WorkerStats *stats;
+    // when the worker last woke up, it's busy from then until it goes idle
+    long long lastNs;
+} Worker;
+
+typedef struct thread_pool {
+    TPConfig config;
     int threadNum;
     OSQueue *queue;
+    // one ring per sub-pool, NULL when there are no rings
+    OSRing **rings;
+    int nodeCount;
+    // sub-pool of every cpu, -1 for the cpus we may not run on, NULL unless numa placement
+    int *cpuNode;
+    OSSlab *taskSlab;
+    OSSlab *handleSlab;
     pthread_t *threads;
+    Worker *workers;
+    // a slot per worker and a last one shared by the other threads that run tasks
+    WorkerStats *stats;
+    // same slots for trace events, NULL when not tracing, times are taken from traceStartNs
+    TraceRing *traces;
+    long long traceStartNs;
     pthread_mutex_t mutex;
-    pthread_cond_t condition;
-    state state;
+    // state in the low bit, submitters inside an insert counted above it, tpDestroy waits for them
+    int state;
+    // tasks in the queue, changed under mutex
+    long queued;
+    // tasks in the queue, the ring and the workers' deques
+    long pending;
+    // tasks inserted and not yet done, futex word for tpWaitIdle
+    int inFlight;
+    int idleWaiters;
+    // priority queues guarded by levelMutex, bit i of levelMask is set while level i isn't empty
+    OSQueue *levels[TP_PRIORITY_LEVELS];
+    unsigned int levelMask;
+    long levelTasks;
+    pthread_mutex_t levelMutex;
+    long long lastNormalNs;
+    // idle registry, a stack of parked workers guarded by idleMutex
+    Worker **idle;
+    int idleCount;
+    pthread_mutex_t idleMutex;
+    // workers spinning for work, submitters do not wake others for them
+    int spinning;
+    // time of the last submission and average time between submissions
+    long long lastArrival;
+    long arrivalNs;
+    // tasks counted against queueCapacity, producers waiting for room sleep on spaceSeq
+    long occupied;
+    int spaceSeq;
+    int spaceWaiters;
+    // timer wheel and its entries guarded by timerMutex, the timer thread starts with the first timer
+    OSWheel *wheel;
+    TimerEntry **timerChunks;
+    unsigned int timerChunkCount;
+    unsigned int timerFree;
+    pthread_mutex_t timerMutex;
+    pthread_cond_t timerCond;
+    pthread_t timerThread;
+    int hasTimerThread;
+    int isTimerStopping;
+    long long timerStartNs;
+    // tick the timer thread sleeps until, -1 while it sleeps with no timers
+    long long timerWakeTick;
+    // running workers, changed under resizeMutex
+    int liveThreads;
+    pthread_mutex_t resizeMutex;
+    // buckets of the keyed tasks' strands, a power of two that grows with threadNum
+    StrandBucket *strandBuckets;
+    unsigned int strandBucketCount;
+    // reactor thread waiting on epollFd, it starts with the first watch and reactorStopFd wakes it
+    // watches indexed by fd are guarded by reactorMutex
+    int epollFd;
+    int reactorStopFd;
+    pthread_t reactorThread;
+    int hasReactor;
+    int isReactorStopping;
+    FdWatch *watches;
+    int watchCapacity;
+    pthread_mutex_t reactorMutex;
 } ThreadPool;
 
 
 // gets num of threads and returns pointer to thread pool
 ThreadPool *tpCreate(int threadNum);
 
-// insert task with args to the thread pool
+// sets default options for num of threads
+void tpConfigInit(TPConfig *config, int threadNum);
+
+// gets options and returns pointer to thread pool
+ThreadPool *tpCreateWithConfig(const TPConfig *config);
+
+// gets min and max num of threads, workers above min exit after idleTimeoutMs without work
+ThreadPool *tpCreateElastic(int minThreads, int maxThreads, long idleTimeoutMs);
+
+// insert task with args to the thread pool, waits for room if the queue is full
 int tpInsertTask(ThreadPool *tp, void (*computeFunc)(void *), void *args);
 
+// insert task with args unless the queue is full, returns -1 if it is
+int tpTryInsertTask(ThreadPool *tp, void (*computeFunc)(void *), void *args);
+
+// insert task with args, waits up to timeoutMs milliseconds for room in the queue and returns -1 after
+int tpInsertTaskTimeout(ThreadPool *tp, void (*computeFunc)(void *), void *args, long timeoutMs);
+
+// insert task with args at a priority level, higher levels are taken first
+int tpInsertTaskPriority(ThreadPool *tp, priority prio, void (*computeFunc)(void *), void *args);
+
+// insert n tasks, the i-th runs computeFuncs[i] with args[i]
+int tpInsertTasks(ThreadPool *tp, void (**computeFuncs)(void *), void **args, int n);
+
+// insert n tasks that run computeFunc, each with its own args
+int tpInsertTaskBatch(ThreadPool *tp, void (*computeFunc)(void *), void **args, int n);
+
+// get a token for tpInsertTaskCancellable, NULL if out of memory
+TPToken *tpCreateToken(void);
+
+// drop every task holding the token that didn't start yet
+void tpCancelToken(TPToken *token);
+
+// 1 if the token was cancelled, running tasks may check it to stop early
+int tpIsTokenCancelled(TPToken *token);
+
+// give up the caller's reference, the token is freed once no task holds it
+void tpReleaseToken(TPToken *token);
+
+// insert task with args, dropped if token is cancelled or deadlineUs microseconds pass before it starts
+// token may be NULL and deadlineUs 0 for neither
+int tpInsertTaskCancellable(ThreadPool *tp, TPToken *token, long deadlineUs, void (*computeFunc)(void *),
+                            void *args);
+
+// insert task with a copy of argSize bytes of args, the task gets a pointer to the copy
+// up to TP_TASK_INLINE bytes are kept in the task, bigger args are copied to the heap
+int tpInsertTaskCopy(ThreadPool *tp, void (*computeFunc)(void *), const void *argBytes, size_t argSize);
+
+// insert task with a copy of args once the queue has room, -1 if it got none in timeoutMs
+int tpInsertTaskCopyTimeout(ThreadPool *tp, void (*computeFunc)(void *), const void *argBytes, size_t argSize,
+                            long timeoutMs);
+
+// insert task with args, tasks of the same key run one at a time in the order they were inserted
+int tpInsertTaskKeyed(ThreadPool *tp, unsigned long key, void (*computeFunc)(void *), void *args);
+
+// insert task with args after delayUs microseconds, returns an id to cancel it or 0
+TPTimerId tpScheduleAfter(ThreadPool *tp, long delayUs, void (*computeFunc)(void *), void *args);
+
+// insert task with args every periodUs microseconds until cancelled, returns an id to cancel it or 0
+TPTimerId tpScheduleEvery(ThreadPool *tp, long periodUs, void (*computeFunc)(void *), void *args);
+
+// cancel a scheduled task, -1 if it's already due or the id is unknown
+int tpCancelTimer(ThreadPool *tp, TPTimerId id);
+
+// insert task with args once fd has one of the epoll events, the watch ends when it fires
+// returns -1 if fd is already watched or epoll refuses it
+int tpWatchFd(ThreadPool *tp, int fd, unsigned int events, void (*computeFunc)(void *), void *args);
+
+// stop watching fd, -1 if its task was already inserted or it isn't watched
+// a fd must not be closed while watched
+int tpUnwatchFd(ThreadPool *tp, int fd);
+
+// block until no task is queued or running, the pool stays usable
+int tpWaitIdle(ThreadPool *tp);
+
+// run body(lo, hi, ctx) over pieces of [begin, end) of at most grain, returns when all are done
+// returns -1 if tpDestroy dropped pieces that didn't start, their part of the range isn't run
+int tpParallelFor(ThreadPool *tp, long begin, long end, long grain,
+                  void (*body)(long, long, void *), void *ctx);
+
+// start an empty group of tasks of tp
+void tpGroupInit(TPGroup *group, ThreadPool *tp);
+
+// insert task with args as part of the group
+int tpGroupInsert(TPGroup *group, void (*computeFunc)(void *), void *args);
+
+// block until the group's tasks are done, a worker of the pool runs other tasks meanwhile
+int tpGroupWait(TPGroup *group);
+
+// insert task whose return value is kept, returns a handle to wait on or NULL
+TPHandle *tpSubmit(ThreadPool *tp, void *(*computeFunc)(void *), void *args);
+
+// block until the handle's task is done and get its return value, result may be NULL
+// returns 1 and a NULL result if the task was dropped without running
+// a worker of the pool runs other tasks meanwhile
+int tpWait(TPHandle *handle, void **result);
+
+// get the return value if the handle's task is done, -1 if it isn't, 1 if it was dropped
+int tpTryWait(TPHandle *handle, void **result);
+
+// like tpWait but gives up after timeoutMs milliseconds and returns -1
+int tpWaitTimeout(TPHandle *handle, long timeoutMs, void **result);
+
+// give the handle back to the thread pool, must happen before tpDestroy
+void tpReleaseHandle(TPHandle *handle);
+
+// aggregate the workers' statistics
+int tpGetStats(ThreadPool *tp, TPStats *stats);
+
+// get the counters of worker id, -1 if there's no such worker
+int tpGetWorkerStats(ThreadPool *tp, int id, TPCounters *counters);
+
+// upper bound in nanoseconds of the p-th fraction of the histogram's values, 0 if it's empty
+long long tpHistogramPercentile(const TPHistogram *histogram, double p);
+
+// write the trace events as chrome trace event json, -1 if not tracing or the file can't be written
+int tpDumpTrace(ThreadPool *tp, const char *path);
+
 // destroy the thread pool
 void tpDestroy(ThreadPool *tp, int shouldWaitForTasks);
 
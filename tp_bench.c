@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "threadPool.h"
+
+
+// options of a benchmark run
+typedef struct {
+    int threads;
+    int producers;
+    // busy loop iterations every task runs
+    long work;
+    long tasks;
+    int repeats;
+    const char *scenario;
+    int isJson;
+} BenchOptions;
+
+// result of one scenario, seconds are the median of the repeats
+typedef struct {
+    const char *scenario;
+    long tasks;
+    double seconds;
+    double bestSeconds;
+    // submit to start latency percentiles, -1 where not measured
+    long long p50Ns;
+    long long p99Ns;
+    long long p999Ns;
+} BenchResult;
+
+typedef struct {
+    long long submitNs;
+    long long *latencyNs;
+    int started;
+} LatencyProbe;
+
+typedef struct {
+    ThreadPool *tp;
+    long tasks;
+} Producer;
+
+typedef struct {
+    ThreadPool *inner;
+    int fanOut;
+} NestedTask;
+
+
+static long work;
+static int isFirstResult = 1;
+
+
+// the function returns monotonic time in nanoseconds
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// the function gets args
+// it spins for the configured amount of work
+static void workTask(void *args) {
+    volatile long sink = 0;
+    long i;
+    (void) args;
+
+    for (i = 0; i < work; ++i) {
+        sink += i;
+    }
+}
+
+
+// the function gets range, its end and ctx
+// it runs the configured work for every index
+static void workRange(long begin, long end, void *ctx) {
+    (void) ctx;
+
+    for (; begin < end; ++begin) {
+        workTask(NULL);
+    }
+}
+
+
+// the function gets latency probe
+// it records how long the task waited to start
+static void latencyTask(void *args) {
+    LatencyProbe *probe = (LatencyProbe *) args;
+
+    *(probe->latencyNs) = nowNs() - probe->submitNs;
+    workTask(NULL);
+    __atomic_store_n(&probe->started, 1, __ATOMIC_RELEASE);
+}
+
+
+// the function gets producer
+// it inserts its share of the tasks
+static void *produce(void *args) {
+    Producer *producer = (Producer *) args;
+    long i;
+
+    for (i = 0; i < producer->tasks; ++i) {
+        tpInsertTask(producer->tp, workTask, NULL);
+    }
+
+    return NULL;
+}
+
+
+// the function gets args of an inner task
+// it returns nothing, the outer task only waits for it
+static void *innerTask(void *args) {
+    workTask(args);
+    return NULL;
+}
+
+
+// the function gets nested task
+// it fans out to the inner pool and waits for all of its tasks
+static void nestedTask(void *args) {
+    NestedTask *nested = (NestedTask *) args;
+    TPHandle *handles[64];
+    int i;
+
+    for (i = 0; i < nested->fanOut; ++i) {
+        handles[i] = tpSubmit(nested->inner, innerTask, NULL);
+    }
+    for (i = 0; i < nested->fanOut; ++i) {
+        tpWait(handles[i], NULL);
+        tpReleaseHandle(handles[i]);
+    }
+}
+
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+static int compareLongLongs(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+// the function gets sorted values, their num and a fraction
+// it returns the value at that fraction
+static long long percentile(const long long *sorted, long n, double p) {
+    long i = (long) (p * (double) n);
+
+    return sorted[(i < n) ? i : n - 1];
+}
+
+
+// the function gets options, result and the seconds of every repeat
+// it keeps the median and the best of the repeats in the result
+static void summarize(const BenchOptions *options, BenchResult *result, double *seconds) {
+    qsort(seconds, (size_t) options->repeats, sizeof(double), compareDoubles);
+    result->seconds = seconds[options->repeats / 2];
+    result->bestSeconds = seconds[0];
+}
+
+
+// the function gets options and a result
+// it prints the result as a csv line or a json object
+static void printResult(const BenchOptions *options, const BenchResult *result) {
+    double perSecond = (result->seconds > 0) ? (double) result->tasks / result->seconds : 0;
+
+    if (options->isJson) {
+        printf("%s  {\"scenario\": \"%s\", \"threads\": %d, \"producers\": %d, \"work\": %ld, "
+               "\"tasks\": %ld, \"seconds\": %.6f, \"bestSeconds\": %.6f, \"tasksPerSecond\": %.0f, "
+               "\"p50Ns\": %lld, \"p99Ns\": %lld, \"p999Ns\": %lld}",
+               isFirstResult ? "" : ",\n", result->scenario, options->threads, options->producers,
+               options->work, result->tasks, result->seconds, result->bestSeconds, perSecond,
+               result->p50Ns, result->p99Ns, result->p999Ns);
+    } else {
+        printf("%s,%d,%d,%ld,%ld,%.6f,%.6f,%.0f,%lld,%lld,%lld\n", result->scenario, options->threads,
+               options->producers, options->work, result->tasks, result->seconds, result->bestSeconds,
+               perSecond, result->p50Ns, result->p99Ns, result->p999Ns);
+    }
+
+    isFirstResult = 0;
+    fflush(stdout);
+}
+
+
+// the function gets options and result
+// one thread inserts all tasks and waits for the pool to go idle
+static void benchThroughput(const BenchOptions *options, BenchResult *result) {
+    double *seconds = (double *) malloc(sizeof(double) * (size_t) options->repeats);
+    int r;
+
+    for (r = 0; r < options->repeats; ++r) {
+        ThreadPool *tp = tpCreate(options->threads);
+        long long start = nowNs();
+        long i;
+        for (i = 0; i < options->tasks; ++i) {
+            tpInsertTask(tp, workTask, NULL);
+        }
+        tpWaitIdle(tp);
+        seconds[r] = (double) (nowNs() - start) / 1e9;
+        tpDestroy(tp, 1);
+    }
+
+    summarize(options, result, seconds);
+    free(seconds);
+}
+
+
+// the function gets options and result
+// tasks are inserted one at a time into a quiet pool, every one records when it started
+static void benchLatency(const BenchOptions *options, BenchResult *result) {
+    long samples = (options->tasks < 10000) ? options->tasks : 10000;
+    long long *latencyNs = (long long *) malloc(sizeof(long long) * (size_t) samples);
+    double *seconds = (double *) malloc(sizeof(double) * (size_t) options->repeats);
+    int r;
+
+    for (r = 0; r < options->repeats; ++r) {
+        ThreadPool *tp = tpCreate(options->threads);
+        long long start = nowNs();
+        long i;
+        for (i = 0; i < samples; ++i) {
+            LatencyProbe probe;
+            probe.latencyNs = &latencyNs[i];
+            probe.started = 0;
+            probe.submitNs = nowNs();
+            tpInsertTask(tp, latencyTask, &probe);
+            while (!__atomic_load_n(&probe.started, __ATOMIC_ACQUIRE)) {
+                sched_yield();
+            }
+        }
+        seconds[r] = (double) (nowNs() - start) / 1e9;
+        tpDestroy(tp, 1);
+    }
+
+    // percentiles of the last repeat
+    qsort(latencyNs, (size_t) samples, sizeof(long long), compareLongLongs);
+    result->tasks = samples;
+    result->p50Ns = percentile(latencyNs, samples, 0.5);
+    result->p99Ns = percentile(latencyNs, samples, 0.99);
+    result->p999Ns = percentile(latencyNs, samples, 0.999);
+
+    summarize(options, result, seconds);
+    free(seconds);
+    free(latencyNs);
+}
+
+
+// the function gets options and result
+// the main thread forks the tasks over the pool with tpParallelFor and joins them, a hundred times
+static void benchForkJoin(const BenchOptions *options, BenchResult *result) {
+    double *seconds = (double *) malloc(sizeof(double) * (size_t) options->repeats);
+    long perRound = options->tasks / 100 + 1;
+    long grain = perRound / (options->threads * 8) + 1;
+    int r;
+
+    for (r = 0; r < options->repeats; ++r) {
+        ThreadPool *tp = tpCreate(options->threads);
+        long long start = nowNs();
+        int round;
+        for (round = 0; round < 100; ++round) {
+            tpParallelFor(tp, 0, perRound, grain, workRange, NULL);
+        }
+        seconds[r] = (double) (nowNs() - start) / 1e9;
+        tpDestroy(tp, 1);
+    }
+
+    result->tasks = perRound * 100;
+    summarize(options, result, seconds);
+    free(seconds);
+}
+
+
+// the function gets options and result
+// all producers insert their share of the tasks at once
+static void benchContention(const BenchOptions *options, BenchResult *result) {
+    double *seconds = (double *) malloc(sizeof(double) * (size_t) options->repeats);
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * (size_t) options->producers);
+    Producer *producers = (Producer *) malloc(sizeof(Producer) * (size_t) options->producers);
+    int r;
+
+    for (r = 0; r < options->repeats; ++r) {
+        ThreadPool *tp = tpCreate(options->threads);
+        long long start = nowNs();
+        int i;
+        for (i = 0; i < options->producers; ++i) {
+            producers[i].tp = tp;
+            producers[i].tasks = options->tasks / options->producers;
+            if (pthread_create(&threads[i], NULL, produce, &producers[i]) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        for (i = 0; i < options->producers; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        tpWaitIdle(tp);
+        seconds[r] = (double) (nowNs() - start) / 1e9;
+        tpDestroy(tp, 1);
+    }
+
+    result->tasks = options->tasks / options->producers * options->producers;
+    summarize(options, result, seconds);
+    free(producers);
+    free(threads);
+    free(seconds);
+}
+
+
+// the function gets options and result
+// tasks of an outer pool fan out to an inner pool and block until their inner tasks are done
+static void benchNested(const BenchOptions *options, BenchResult *result) {
+    double *seconds = (double *) malloc(sizeof(double) * (size_t) options->repeats);
+    NestedTask nested;
+    long outerTasks = options->tasks / 16 + 1;
+    int r;
+
+    nested.fanOut = 16;
+    for (r = 0; r < options->repeats; ++r) {
+        ThreadPool *outer = tpCreate(options->threads);
+        nested.inner = tpCreate(options->threads);
+        long long start = nowNs();
+        long i;
+        for (i = 0; i < outerTasks; ++i) {
+            tpInsertTask(outer, nestedTask, &nested);
+        }
+        tpWaitIdle(outer);
+        seconds[r] = (double) (nowNs() - start) / 1e9;
+        tpDestroy(outer, 1);
+        tpDestroy(nested.inner, 1);
+    }
+
+    result->tasks = outerTasks * (nested.fanOut + 1);
+    summarize(options, result, seconds);
+    free(seconds);
+}
+
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-t threads] [-p producers] [-w work] [-n tasks] [-r repeats]\n"
+                    "          [-b all|throughput|latency|forkjoin|contention|nested] [-f csv|json]\n", name);
+    exit(2);
+}
+
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    options.threads = 4;
+    options.producers = 4;
+    options.work = 0;
+    options.tasks = 1000000;
+    options.repeats = 5;
+    options.scenario = "all";
+    options.isJson = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "t:p:w:n:r:b:f:h")) != -1) {
+        switch (option) {
+            case 't':
+                options.threads = atoi(optarg);
+                break;
+            case 'p':
+                options.producers = atoi(optarg);
+                break;
+            case 'w':
+                options.work = atol(optarg);
+                break;
+            case 'n':
+                options.tasks = atol(optarg);
+                break;
+            case 'r':
+                options.repeats = atoi(optarg);
+                break;
+            case 'b':
+                options.scenario = optarg;
+                break;
+            case 'f':
+                if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0) {
+                    usage(argv[0]);
+                }
+                options.isJson = (strcmp(optarg, "json") == 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (options.threads < 1 || options.producers < 1 || options.work < 0 || options.tasks < 1
+        || options.repeats < 1) {
+        usage(argv[0]);
+    }
+    work = options.work;
+
+    struct {
+        const char *name;
+        void (*run)(const BenchOptions *, BenchResult *);
+    } scenarios[] = {
+            {"throughput", benchThroughput},
+            {"latency",    benchLatency},
+            {"forkjoin",   benchForkJoin},
+            {"contention", benchContention},
+            {"nested",     benchNested}
+    };
+    int count = sizeof(scenarios) / sizeof(scenarios[0]);
+    int isAll = (strcmp(options.scenario, "all") == 0);
+    int isKnown = isAll;
+    int i;
+    for (i = 0; i < count; ++i) {
+        isKnown |= (strcmp(options.scenario, scenarios[i].name) == 0);
+    }
+    if (!isKnown) {
+        usage(argv[0]);
+    }
+
+    if (options.isJson) {
+        printf("[\n");
+    } else {
+        printf("scenario,threads,producers,work,tasks,seconds,bestSeconds,tasksPerSecond,p50Ns,p99Ns,p999Ns\n");
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (!isAll && strcmp(options.scenario, scenarios[i].name) != 0) {
+            continue;
+        }
+
+        BenchResult result;
+        result.scenario = scenarios[i].name;
+        result.tasks = options.tasks;
+        result.p50Ns = result.p99Ns = result.p999Ns = -1;
+        scenarios[i].run(&options, &result);
+        printResult(&options, &result);
+    }
+
+    if (options.isJson) {
+        printf("\n]\n");
+    }
+
+    return 0;
+}